@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,85 +6,837 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netdb.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
+#include <poll.h>
 #include <fcntl.h>  // For fcntl()
 #include <sys/select.h> // Include necessary header for select()
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <endian.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 
 #include "RUDP_API.h"
+#include "RUDP_Compress.h"
+#include "RUDP_Trace.h"
+#include "Util_Digest.h"
+#include "Util_Tune.h"
 
 
 // #define BUFFER_SIZE 1024
-#define TIMEOUT_SEC 5 // Timeout in seconds for receiving acknowledgments
 
 // Define flags for the RUDP protocol
 #define SYN_FLAG    0x01
 #define SYN_ACK_FLAG 0x02
 #define ACK_FLAG    0x04
+#define RESUME_FLAG 0x20 // SYN resuming an earlier connection, or SYN-ACK accepting the resumption
 
-#define END_FLAG 0x08    // Flag indicating end of transmission
+#define FIN_FLAG 0x08    // The sender of this packet closes the connection, answered with FIN_FLAG | ACK_FLAG
+#define KEEPALIVE_FLAG 0x40 // Probe asking the peer for an ACK to show it is still there, with ACK_FLAG the answer to one
+#define EOM_FLAG 0x10    // Flag marking the last segment of a message
+#define FEC_FLAG 0x80    // XOR parity over one group of a block of data segments
+#define COMPRESSED_FLAG 0x100 // The segment's data is compressed, raw_length gives its size before
+#define DIGEST_FLAG 0x200 // The segment belongs to a verified message, the last one carries the digest in echo_time_us
 
 #define MAX_UDP_PAYLOAD_SIZE 65507
 
+#define SEND_WINDOW_SEGMENTS 64 // Most segments rudp_send keeps in flight
+#define DEFAULT_RCVBUF (4 * 1024 * 1024) // Kernel receive buffer requested for every socket
+#define INITIAL_RTO_US 1000000 // Retransmission timeout before the first RTT sample
+#define MIN_RTO_US 200000
+#define MAX_RTO_US 60000000
+#define MAX_RETRIES 8 // Timeouts in a row before the peer is considered gone
+#define DUP_ACK_THRESHOLD 3 // Repeated ACKs that trigger a fast retransmission
+#define HANDSHAKE_RETRIES 5 // SYN or SYN-ACK retransmissions before the handshake fails
+#define FIN_RETRIES 5 // FIN retransmissions before rudp_disconnect gives up on the FIN-ACK
+#define PACING_GAIN_PERCENT 125 // Pace a little faster than window / RTT so pacing alone never limits the window
+#define PACING_BURST_US 1000 // Sending credit a late pacer may catch up on at once, covers poll()'s millisecond granularity
+
+#define CACHE_LINE_SIZE 64
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define REORDER_SEGMENTS 64 // Segments the receiver holds past a gap, a power of two so a sequence number masks to its slot
+#define REORDER_MASK (REORDER_SEGMENTS - 1)
+#define FEC_MAX_DATA 32 // Most data segments in a forward error correction block
+#define FEC_MAX_PARITY 8 // Most parity segments per block
+#define POOL_SEGMENTS (SEND_WINDOW_SEGMENTS + 2 + FEC_MAX_PARITY) // The send window and its read-ahead, or the reorder ring, plus the segment being received and the parities being built
+#define SEGMENT_CORRUPT -2 // What deliver_segment returns for data that does not decompress, the segment is dropped and resent
+
+
+//a segment buffer taken from the socket's pool
+typedef struct Segment {
+    RUDP_Packet packet;
+    long long sent_at; // When the segment was last sent, in microseconds
+    bool retransmitted; // Retransmitted segments give no RTT sample (Karn's algorithm)
+    struct Segment *next_free; // Next unused segment while this one is in the free list
+} Segment;
+
+//preallocated, cache-line aligned segments so the data path never touches the heap
+typedef struct {
+    unsigned char *memory;
+    size_t memory_size;
+    size_t stride; // Size of one segment rounded up to a whole number of cache lines
+    Segment *free_list;
+    unsigned int in_use;
+} SegmentPool;
+
+//what arrived of the forward error correction block the next expected segment belongs to
+typedef struct {
+    uint32_t start; // First sequence number of the block
+    uint32_t length; // Data segments in the block as told by a parity, 0 until one arrived
+    uint32_t received; // Bit i is set once segment start + i arrived or was rebuilt
+    uint32_t parity_seen; // Bit j is set once parity j arrived
+    Segment *group_sum[FEC_MAX_PARITY]; // XOR of everything that arrived of group j, parity included
+} FecBlock;
+
 
 typedef struct _rudp_socket {
     int socket_fd; // UDP socket file descriptor
     bool isServer; // True if the RUDP socket acts like a server, false for client.
     bool isConnected; // True if there is an active connection, false otherwise.
-    struct sockaddr_in dest_addr; // Destination address. 
+    int family; // AF_INET6 for a dual-stack socket, AF_INET where the host has no IPv6
+    struct sockaddr_storage dest_addr; // Destination address, IPv4 or IPv6
+    uint32_t conn_id; // Connection ID, every packet of the connection carries it
+    uint16_t mss; // Largest data payload per segment, offered before and negotiated after the handshake
+    uint8_t checksum_type; // Checksum asked for before and negotiated after the handshake
+    bool handshake_pending; // A resumed connection whose SYN-ACK has not arrived yet
+    bool peer_closed; // The peer sent a FIN that we acknowledged, rudp_disconnect lingers for repeats of it
+    uint16_t offered_mss; // MSS offered in every handshake, see rudp_set_mss
+    uint8_t offered_checksum; // Checksum type asked for in every handshake, see rudp_set_checksum
+    uint8_t fec_data; // Data segments per FEC block, offered before and negotiated after the handshake, 0 without FEC
+    uint8_t fec_parity; // Parity segments per FEC block
+    uint8_t offered_fec_data; // FEC asked for in every handshake, see rudp_set_fec
+    uint8_t offered_fec_parity;
+    uint8_t compression; // Payload compression, offered before and negotiated after the handshake
+    uint8_t offered_compression; // Compression asked for in every handshake, see rudp_set_compression
+    char codec_buffer[RUDP_MAX_DATA]; // Where a segment is compressed before sending and decompressed before delivery
+    FecBlock fec; // The FEC block being received
+    Segment *reorder[REORDER_SEGMENTS]; // Segments that arrived past a gap, in the slot seq_num & REORDER_MASK
+    uint32_t send_msg_id; // ID of the next message rudp_send sends
+    uint32_t recv_msg_id; // ID of the next message rudp_recv expects
+    long long linger_us; // How long rudp_disconnect keeps answering FINs after the peer closed, 0 for twice the RTO
+    long long keepalive_us; // Probe the peer after this long without hearing from it, 0 to never probe
+    long long idle_timeout_us; // Drop the connection after this long without hearing from the peer, 0 to wait forever
+    long long last_recv_us; // When the last packet of this connection arrived
+    long long last_probe_us; // When the last keepalive probe was sent
+    unsigned long long pacing_rate; // Fixed pacing rate in bytes per second, 0 to derive it from the window and the RTT
+    unsigned long long kernel_pacing_rate; // Rate last handed to SO_MAX_PACING_RATE
+    long long pace_next_us; // Earliest departure time of the next segment
+    bool timestamping; // Whether the kernel stamps arriving datagrams, see rudp_set_timestamping
+    uint64_t echo_time_us; // send_time_us of the segment that last advanced recv_seq, echoed in our ACKs
+    RUDP_Stats stats; // Delay measurements and verification counts of the connection
+    bool verify; // Whether rudp_send sends a digest of every message, see rudp_set_verify
+    Util_Digest send_digest; // Of the data of the message being sent so far
+    Util_Digest recv_digest; // Of the data of the message being received so far
+    bool digest_mismatch; // The message being received did not match its digest
+    RUDP_Trace *trace; // Event trace being written, NULL when tracing is off
+    uint64_t resume_token; // Token the server issued for resuming later
+    uint64_t resume_secret; // Key of the tokens this socket hands out as a server, drawn once in rudp_socket
+    RUDP_Handshake last_handshake; // Our last SYN or SYN-ACK, repeated when the peer did not get it
+    uint32_t send_seq; // Sequence number of the next segment to send
+    uint32_t recv_seq; // Sequence number of the next segment expected from the peer
+    uint32_t recv_window; // Receive buffer space we advertise to the peer, in bytes
+    uint32_t peer_window; // Receive buffer space last advertised by the peer, in bytes
+    long long srtt_us; // Smoothed round-trip time, 0 until the first sample
+    long long rttvar_us; // Round-trip time variation
+    long long rto_us; // Current retransmission timeout
+    SegmentPool pool; // Buffers for every segment the socket holds
+    Segment *send_window[SEND_WINDOW_SEGMENTS + 1]; // Segments in flight and the one read ahead
 } RUDP_Socket;
 
-int sequence_number = 0; // Initial sequence number
-unsigned expected_sequence_number = 0; // Initial expected sequence number
 
+//maps the pool's memory, preferring huge pages, and threads every segment on the free list
+static int pool_init(SegmentPool *pool, unsigned int count) {
+    pool->stride = (sizeof(Segment) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    pool->memory_size = (pool->stride * count + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    pool->memory = mmap(NULL, pool->memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (pool->memory == MAP_FAILED) {
+        //no huge pages reserved, use normal pages and let the kernel merge them if it can
+        pool->memory_size = pool->stride * count;
+        pool->memory = mmap(NULL, pool->memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (pool->memory == MAP_FAILED) {
+            return -1;
+        }
+        madvise(pool->memory, pool->memory_size, MADV_HUGEPAGE);
+    }
+
+    pool->free_list = NULL;
+    for (unsigned int i = count; i > 0; i--) {
+        Segment *segment = (Segment *)(pool->memory + (i - 1) * pool->stride);
+        segment->next_free = pool->free_list;
+        pool->free_list = segment;
+    }
+    pool->in_use = 0;
+    return 0;
+}
+
+static void pool_destroy(SegmentPool *pool) {
+    if (pool->memory != NULL) {
+        munmap(pool->memory, pool->memory_size);
+        pool->memory = NULL;
+    }
+}
+
+//takes a segment from the pool, NULL when all of them are in use
+static Segment *pool_get(SegmentPool *pool) {
+    Segment *segment = pool->free_list;
+    if (segment != NULL) {
+        pool->free_list = segment->next_free;
+        pool->in_use++;
+    }
+    return segment;
+}
+
+static void pool_put(SegmentPool *pool, Segment *segment) {
+    segment->next_free = pool->free_list;
+    pool->free_list = segment;
+    pool->in_use--;
+}
+
+
+//monotonic clock in microseconds for the retransmission timers
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//wall clock in microseconds, the clock of the kernel's receive timestamps and, when synchronized, of the peer
+static long long wall_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//records a protocol event when tracing is on
+static void trace_event(RUDP_Socket *sockfd, uint16_t type, uint16_t reason, uint32_t seq, uint32_t length, unsigned long long window, uint64_t value) {
+    if (sockfd->trace == NULL) {
+        return;
+    }
+    RUDP_TraceEvent event;
+    event.time_us = (uint64_t)now_us();
+    event.value = value;
+    event.conn_id = sockfd->conn_id;
+    event.seq = seq;
+    event.length = length;
+    event.window = window > 0xffffffffULL ? 0xffffffffU : (uint32_t)window;
+    event.type = type;
+    event.reason = reason;
+    event.reserved = 0;
+    rudp_trace_push(sockfd->trace, &event);
+}
+
+//updates the RTT estimate and the retransmission timeout as in RFC 6298
+static void update_rtt(RUDP_Socket *sockfd, long long sample_us) {
+    if (sockfd->srtt_us == 0) {
+        sockfd->srtt_us = sample_us;
+        sockfd->rttvar_us = sample_us / 2;
+    } else {
+        long long delta = sockfd->srtt_us - sample_us;
+        if (delta < 0) {
+            delta = -delta;
+        }
+        sockfd->rttvar_us = (3 * sockfd->rttvar_us + delta) / 4;
+        sockfd->srtt_us = (7 * sockfd->srtt_us + sample_us) / 8;
+    }
+    sockfd->rto_us = sockfd->srtt_us + 4 * sockfd->rttvar_us;
+    if (sockfd->rto_us < MIN_RTO_US) {
+        sockfd->rto_us = MIN_RTO_US;
+    } else if (sockfd->rto_us > MAX_RTO_US) {
+        sockfd->rto_us = MAX_RTO_US;
+    }
+}
+
+//a random number for connection IDs, initial sequence numbers and resume secrets
+static uint64_t random_u64(void) {
+    uint64_t value;
+    if (getrandom(&value, sizeof(value), 0) != sizeof(value)) {
+        value = ((uint64_t)getpid() << 32) ^ (uint64_t)now_us();
+    }
+    return value;
+}
+
+//the splitmix64 finalizer, scrambles a 64-bit value so every input bit affects every output bit
+static uint64_t splitmix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+//the token a server hands out for resuming: a keyed hash of the peer and the parameters agreed on, so the server does not have to remember it
+static uint64_t resume_token_for(RUDP_Socket *sockfd, const struct sockaddr_storage *peer, const RUDP_Handshake *params) {
+    uint64_t secret = sockfd->resume_secret;
+    //the secret and the peer's address, 4 or 16 bytes of it, then the negotiated parameters
+    uint64_t words[2] = {0, 0};
+    if (peer->ss_family == AF_INET6) {
+        memcpy(words, &((const struct sockaddr_in6 *)peer)->sin6_addr, sizeof(words));
+    } else {
+        memcpy(words, &((const struct sockaddr_in *)peer)->sin_addr, sizeof(struct in_addr));
+    }
+    uint64_t packed = (uint64_t)params->mss | ((uint64_t)params->checksum_type << 16) | ((uint64_t)params->fec_data << 24) |
+                      ((uint64_t)params->fec_parity << 32) | ((uint64_t)params->compression << 40);
+    return splitmix64(splitmix64(splitmix64(secret ^ words[0]) ^ words[1]) ^ packed);
+}
+
+//waits until the socket is readable or the timeout passes, returns poll()'s result
+static int wait_readable(int fd, long long timeout_us) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1, timeout_us > 0 ? (int)((timeout_us + 999) / 1000) : 0);
+}
+
+//fields of the wire header are big-endian at fixed offsets, memcpy keeps them clear of alignment traps and compiles to plain loads and stores
+static void put16(unsigned char *wire, uint16_t value) {
+    value = htons(value);
+    memcpy(wire, &value, sizeof(value));
+}
+
+static void put32(unsigned char *wire, uint32_t value) {
+    value = htonl(value);
+    memcpy(wire, &value, sizeof(value));
+}
+
+static void put64(unsigned char *wire, uint64_t value) {
+    value = htobe64(value);
+    memcpy(wire, &value, sizeof(value));
+}
+
+static uint16_t get16(const unsigned char *wire) {
+    uint16_t value;
+    memcpy(&value, wire, sizeof(value));
+    return ntohs(value);
+}
+
+static uint32_t get32(const unsigned char *wire) {
+    uint32_t value;
+    memcpy(&value, wire, sizeof(value));
+    return ntohl(value);
+}
+
+static uint64_t get64(const unsigned char *wire) {
+    uint64_t value;
+    memcpy(&value, wire, sizeof(value));
+    return be64toh(value);
+}
+
+//writes a header in wire order, the layout is described in RUDP_API.h
+static void encode_header(unsigned char *wire, const RUDPHeader *header, uint32_t seq) {
+    put16(wire, RUDP_WIRE_MAGIC);
+    wire[2] = RUDP_WIRE_VERSION;
+    wire[3] = header->type;
+    put16(wire + 4, header->flags);
+    put16(wire + 6, header->length);
+    put16(wire + 8, header->checksum);
+    put16(wire + 10, header->raw_length);
+    put32(wire + 12, header->conn_id);
+    put32(wire + 16, header->msg_id);
+    put32(wire + 20, seq);
+    put32(wire + 24, header->ack_num);
+    put32(wire + 28, header->window);
+    put64(wire + 32, header->send_time_us);
+    put64(wire + 40, header->echo_time_us);
+}
+
+static void decode_header(const unsigned char *wire, RUDPHeader *header, uint32_t *seq) {
+    header->type = wire[3];
+    header->flags = get16(wire + 4);
+    header->length = get16(wire + 6);
+    header->checksum = get16(wire + 8);
+    header->raw_length = get16(wire + 10);
+    header->conn_id = get32(wire + 12);
+    header->msg_id = get32(wire + 16);
+    *seq = get32(wire + 20);
+    header->ack_num = get32(wire + 24);
+    header->window = get32(wire + 28);
+    header->send_time_us = get64(wire + 32);
+    header->echo_time_us = get64(wire + 40);
+}
+
+// Writes a header and its sequence number in the wire format
+void rudp_encode_header(void *wire, const RUDPHeader *header, uint32_t seq) {
+    encode_header(wire, header, seq);
+}
+
+// Reads a header in the wire format, -1 when it is not a RUDP header of our version
+int rudp_decode_header(const void *wire, size_t size, RUDPHeader *header, uint32_t *seq) {
+    const unsigned char *bytes = wire;
+    if (size < RUDP_WIRE_HEADER_SIZE || get16(bytes) != RUDP_WIRE_MAGIC || bytes[2] != RUDP_WIRE_VERSION) {
+        return -1;
+    }
+    decode_header(bytes, header, seq);
+    return 0;
+}
+
+//adds data to a one's complement sum of 16-bit words in host order, an odd last byte is padded with a zero.
+//returns the sum folded to 16 bits, pieces of even length can be summed one after the other.
+static uint32_t checksum_add(uint32_t sum, const void *data, size_t bytes) {
+    const unsigned char *bytes_pointer = data;
+    uint64_t total_sum = sum;
+    for (; bytes > 1; bytes -= 2, bytes_pointer += 2) {
+        uint16_t word;
+        memcpy(&word, bytes_pointer, sizeof(word));
+        total_sum += word;
+    }
+    if (bytes > 0) {
+        unsigned char last[2] = {*bytes_pointer, 0};
+        uint16_t word;
+        memcpy(&word, last, sizeof(word));
+        total_sum += word;
+    }
+    while (total_sum >> 16) {
+        total_sum = (total_sum & 0xFFFF) + (total_sum >> 16);
+    }
+    return (uint32_t)total_sum;
+}
+
+//the complemented sum as a value in network order, for put16: summing in host order gives the
+//network order sum with its bytes swapped (RFC1071 section 2), which ntohs undoes on every host
+static uint16_t checksum_finish(uint32_t sum) {
+    return ntohs((uint16_t)~sum);
+}
+
+//checksum of a segment as negotiated for the connection: its header in wire order with the checksum field zeroed, then its data
+static uint16_t segment_checksum(RUDP_Socket *sockfd, const RUDPHeader *header, uint32_t seq, const void *data, unsigned int bytes) {
+    if (sockfd->checksum_type == RUDP_CHECKSUM_NONE) {
+        return 0;
+    }
+    unsigned char wire[RUDP_WIRE_HEADER_SIZE];
+    encode_header(wire, header, seq);
+    put16(wire + 8, 0);
+    return checksum_finish(checksum_add(checksum_add(0, wire, sizeof(wire)), data, bytes));
+}
+
+//the parameters of a SYN or SYN-ACK that follow its header
+static void encode_handshake_body(unsigned char *body, const RUDP_Handshake *handshake) {
+    put16(body, handshake->mss);
+    body[2] = handshake->checksum_type;
+    body[3] = handshake->fec_data;
+    body[4] = handshake->fec_parity;
+    body[5] = handshake->compression;
+    put64(body + 6, handshake->resume_token);
+}
+
+static void decode_handshake_body(const unsigned char *body, RUDP_Handshake *handshake) {
+    handshake->mss = get16(body);
+    handshake->checksum_type = body[2];
+    handshake->fec_data = body[3];
+    handshake->fec_parity = body[4];
+    handshake->compression = body[5];
+    handshake->resume_token = get64(body + 6);
+}
+
+//length of an address of either family, as the socket calls take it
+static socklen_t addr_size(const struct sockaddr_storage *addr) {
+    return addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+//sends a header followed by its payload as one datagram, the payload is not copied
+static ssize_t send_datagram(RUDP_Socket *sockfd, const RUDPHeader *header, uint32_t seq, const void *payload, size_t payload_size,
+                             const struct sockaddr_storage *addr) {
+    unsigned char wire[RUDP_WIRE_HEADER_SIZE];
+    encode_header(wire, header, seq);
+    struct iovec iov[2] = {{wire, sizeof(wire)}, {(void *)payload, payload_size}};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)addr;
+    msg.msg_namelen = addr_size(addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = payload_size > 0 ? 2 : 1;
+    return sendmsg(sockfd->socket_fd, &msg, 0);
+}
+
+//sends an ACK, FIN or keepalive probe, they have no payload
+static void send_control(RUDP_Socket *sockfd, RUDPHeader *header, const struct sockaddr_storage *addr) {
+    header->type = RUDP_TYPE_CONTROL;
+    send_datagram(sockfd, header, 0, NULL, 0, addr);
+}
+
+//when a datagram arrived, 0 for the stamps the kernel did not give
+typedef struct {
+    long long user_us; // When rudp read it
+    long long kernel_us; // When the kernel received it
+    long long hardware_us; // When the network card received it, in the card's clock
+} Arrival;
+
+static long long timespec_us(const struct timespec *ts) {
+    return (long long)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+//takes the next datagram off the socket: the header is decoded and the payload lands straight in up to capacity bytes at payload.
+//returns the full payload size, which is more than capacity for a datagram cut short, or -1 on error.
+//the header's type is RUDP_TYPE_NONE for a datagram that is not RUDP of our version or whose payload does not match its type.
+//addr and arrival may be NULL, arrival also takes the kernel's receive timestamps when timestamping is on.
+static ssize_t recv_datagram(RUDP_Socket *sockfd, int flags, RUDPHeader *header, uint32_t *seq, void *payload, size_t capacity,
+                             struct sockaddr_storage *addr, socklen_t *addr_len, Arrival *arrival) {
+    unsigned char wire[RUDP_WIRE_HEADER_SIZE];
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct iovec iov[2] = {{wire, sizeof(wire)}, {payload, capacity}};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = addr != NULL ? *addr_len : 0;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = capacity > 0 ? 2 : 1;
+    if (arrival != NULL && sockfd->timestamping) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+    }
+    //MSG_TRUNC makes the kernel report the datagram's full size
+    ssize_t bytes_received = recvmsg(sockfd->socket_fd, &msg, flags | MSG_TRUNC);
+    if (arrival != NULL) {
+        arrival->user_us = wall_us();
+        arrival->kernel_us = 0;
+        arrival->hardware_us = 0;
+    }
+    if (bytes_received < 0) {
+        return -1;
+    }
+    if (addr != NULL) {
+        *addr_len = msg.msg_namelen;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); arrival != NULL && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+            arrival->kernel_us = timespec_us(&stamps.ts[0]);
+            arrival->hardware_us = timespec_us(&stamps.ts[2]);
+        }
+    }
+
+    if (rudp_decode_header(wire, (size_t)bytes_received, header, seq) < 0) {
+        memset(header, 0, sizeof(*header));
+        *seq = 0;
+        return 0;
+    }
+    size_t payload_size = (size_t)bytes_received - RUDP_WIRE_HEADER_SIZE;
+    bool matches = (header->type == RUDP_TYPE_CONTROL && payload_size == 0) ||
+                   (header->type == RUDP_TYPE_HANDSHAKE && payload_size == RUDP_HANDSHAKE_BODY_SIZE) ||
+                   (header->type == RUDP_TYPE_DATA && ((header->flags & FEC_FLAG) || payload_size == header->length));
+    if (!matches) {
+        header->type = RUDP_TYPE_NONE;
+    }
+    return (ssize_t)payload_size;
+}
+
+//takes the next datagram off the socket where only control packets and handshakes matter, a data segment is cut short.
+//returns the payload size or -1 on error
+static ssize_t recv_control(RUDP_Socket *sockfd, int flags, RUDP_Handshake *control, struct sockaddr_storage *addr, socklen_t *addr_len) {
+    unsigned char body[RUDP_HANDSHAKE_BODY_SIZE];
+    ssize_t payload_size = recv_datagram(sockfd, flags, &control->header, &control->isn, body, sizeof(body), addr, addr_len, NULL);
+    if (payload_size >= 0 && control->header.type == RUDP_TYPE_HANDSHAKE) {
+        decode_handshake_body(body, control);
+    }
+    return payload_size;
+}
+
+//fills in the parameters this side offers in a SYN or SYN-ACK
+static void build_handshake(RUDP_Socket *sockfd, RUDP_Handshake *handshake, uint16_t flags, uint64_t resume_token) {
+    memset(handshake, 0, sizeof(*handshake));
+    handshake->header.type = RUDP_TYPE_HANDSHAKE;
+    handshake->header.flags = flags;
+    handshake->header.conn_id = sockfd->conn_id;
+    handshake->header.ack_num = sockfd->recv_seq;
+    handshake->header.window = sockfd->recv_window;
+    handshake->isn = sockfd->send_seq;
+    handshake->mss = sockfd->mss;
+    handshake->checksum_type = sockfd->checksum_type;
+    handshake->fec_data = sockfd->fec_data;
+    handshake->fec_parity = sockfd->fec_parity;
+    handshake->compression = sockfd->compression;
+    handshake->resume_token = resume_token;
+}
+
+static int send_handshake(RUDP_Socket *sockfd, RUDP_Handshake *handshake) {
+    sockfd->last_handshake = *handshake;
+    unsigned char body[RUDP_HANDSHAKE_BODY_SIZE];
+    encode_handshake_body(body, handshake);
+    return send_datagram(sockfd, &handshake->header, handshake->isn, body, sizeof(body), &sockfd->dest_addr) < 0 ? -1 : 0;
+}
+
+//the final ACK of the handshake, also repeated whenever the server repeats its SYN-ACK
+static void send_handshake_ack(RUDP_Socket *sockfd) {
+    RUDPHeader ack_packet;
+    memset(&ack_packet, 0, sizeof(ack_packet));
+    ack_packet.flags = ACK_FLAG;
+    ack_packet.conn_id = sockfd->conn_id;
+    ack_packet.ack_num = sockfd->recv_seq;
+    ack_packet.window = sockfd->recv_window;
+    send_control(sockfd, &ack_packet, &sockfd->dest_addr);
+}
+
+//takes on what the server chose in its SYN-ACK and acknowledges it
+static void apply_syn_ack(RUDP_Socket *sockfd, const RUDP_Handshake *syn_ack) {
+    sockfd->recv_seq = syn_ack->isn;
+    sockfd->peer_window = syn_ack->header.window;
+    sockfd->mss = syn_ack->mss;
+    sockfd->checksum_type = syn_ack->checksum_type;
+    sockfd->fec_data = syn_ack->fec_data;
+    sockfd->fec_parity = syn_ack->fec_parity;
+    sockfd->compression = syn_ack->compression;
+    sockfd->resume_token = syn_ack->resume_token;
+    sockfd->handshake_pending = false;
+    send_handshake_ack(sockfd);
+}
+
+//answers handshake packets showing up once the connection is up: a SYN repeated by the client, or a SYN-ACK the client is still waiting for or that the server repeated
+static void handle_late_handshake(RUDP_Socket *sockfd, const RUDP_Handshake *handshake) {
+    if (handshake->header.conn_id != sockfd->conn_id) {
+        return;
+    }
+    if (sockfd->isServer && (handshake->header.flags & SYN_FLAG)) {
+        RUDP_Handshake syn_ack_packet = sockfd->last_handshake;
+        send_handshake(sockfd, &syn_ack_packet);
+    } else if (!sockfd->isServer && (handshake->header.flags & SYN_ACK_FLAG)) {
+        if (sockfd->handshake_pending) {
+            apply_syn_ack(sockfd, handshake);
+        } else {
+            send_handshake_ack(sockfd);
+        }
+    }
+}
+
+//every connection starts from the configured offers and the first message ID
+static void reset_connection_state(RUDP_Socket *sockfd) {
+    sockfd->mss = sockfd->offered_mss;
+    sockfd->checksum_type = sockfd->offered_checksum;
+    sockfd->fec_data = sockfd->offered_fec_data;
+    sockfd->fec_parity = sockfd->offered_fec_parity;
+    sockfd->compression = sockfd->offered_compression;
+    sockfd->handshake_pending = false;
+    sockfd->peer_closed = false;
+    sockfd->send_msg_id = 1;
+    sockfd->recv_msg_id = 1;
+    sockfd->echo_time_us = 0;
+    memset(&sockfd->stats, 0, sizeof(sockfd->stats));
+}
+
+//sends a FIN, or a FIN-ACK when flags also has ACK_FLAG
+static void send_fin(RUDP_Socket *sockfd, uint16_t flags) {
+    RUDPHeader fin_packet;
+    memset(&fin_packet, 0, sizeof(fin_packet));
+    fin_packet.flags = flags;
+    fin_packet.conn_id = sockfd->conn_id;
+    fin_packet.ack_num = sockfd->recv_seq;
+    fin_packet.window = sockfd->recv_window;
+    send_control(sockfd, &fin_packet, &sockfd->dest_addr);
+}
+
+//true for a FIN (not a FIN-ACK) belonging to this connection
+static bool is_peer_fin(RUDP_Socket *sockfd, const RUDPHeader *header) {
+    return (header->flags & FIN_FLAG) && !(header->flags & ACK_FLAG) && header->conn_id == sockfd->conn_id;
+}
+
+//the peer closed the connection: acknowledge it, rudp_disconnect will linger for repeats
+static void accept_peer_fin(RUDP_Socket *sockfd) {
+    send_fin(sockfd, FIN_FLAG | ACK_FLAG);
+    sockfd->isConnected = false;
+    sockfd->peer_closed = true;
+}
+
+//the handshake is done, the connection timers start from now
+static void connection_established(RUDP_Socket *sockfd) {
+    sockfd->isConnected = true;
+    sockfd->last_recv_us = now_us();
+    sockfd->last_probe_us = sockfd->last_recv_us;
+}
+
+//earliest of the connection timers (keepalive probe, idle timeout) and the caller's own deadline, -1 when nothing is armed
+static long long timer_deadline(RUDP_Socket *sockfd, long long deadline) {
+    if (sockfd->keepalive_us > 0) {
+        long long last = sockfd->last_recv_us > sockfd->last_probe_us ? sockfd->last_recv_us : sockfd->last_probe_us;
+        long long probe_at = last + sockfd->keepalive_us;
+        if (deadline < 0 || probe_at < deadline) {
+            deadline = probe_at;
+        }
+    }
+    if (sockfd->idle_timeout_us > 0) {
+        long long idle_at = sockfd->last_recv_us + sockfd->idle_timeout_us;
+        if (deadline < 0 || idle_at < deadline) {
+            deadline = idle_at;
+        }
+    }
+    return deadline;
+}
+
+//fires the connection timers that expired, returns -1 once the peer has been silent for longer than the idle timeout
+static int run_timers(RUDP_Socket *sockfd) {
+    long long now = now_us();
+    if (sockfd->idle_timeout_us > 0 && now - sockfd->last_recv_us >= sockfd->idle_timeout_us) {
+        fprintf(stderr, "Peer idle for too long, dropping the connection.\n");
+        sockfd->isConnected = false;
+        sockfd->conn_id = 0;
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    long long last = sockfd->last_recv_us > sockfd->last_probe_us ? sockfd->last_recv_us : sockfd->last_probe_us;
+    if (sockfd->keepalive_us > 0 && now - last >= sockfd->keepalive_us) {
+        RUDPHeader probe_packet;
+        memset(&probe_packet, 0, sizeof(probe_packet));
+        probe_packet.flags = KEEPALIVE_FLAG;
+        probe_packet.conn_id = sockfd->conn_id;
+        probe_packet.ack_num = sockfd->recv_seq;
+        probe_packet.window = sockfd->recv_window;
+        send_control(sockfd, &probe_packet, &sockfd->dest_addr);
+        sockfd->last_probe_us = now;
+    }
+    return 0;
+}
+
+//acknowledges everything received in order so far and advertises how much more we can take.
+//flags is KEEPALIVE_FLAG for the answer to a probe, 0 otherwise.
+static void send_ack(RUDP_Socket *sockfd, const struct sockaddr_storage *addr, unsigned long long capacity, uint16_t flags) {
+    RUDPHeader ack_packet;
+    memset(&ack_packet, 0, sizeof(ack_packet));
+    ack_packet.flags = ACK_FLAG | flags;
+    ack_packet.conn_id = sockfd->conn_id;
+    ack_packet.ack_num = sockfd->recv_seq;
+    ack_packet.window = capacity < sockfd->recv_window ? (uint32_t)capacity : sockfd->recv_window;
+    ack_packet.echo_time_us = sockfd->echo_time_us;
+    send_control(sockfd, &ack_packet, addr);
+}
+
+//a keepalive probe of this connection, which asks for an ACK, unlike the answer to one
+static bool is_probe(RUDP_Socket *sockfd, const RUDPHeader *header) {
+    return header->type == RUDP_TYPE_CONTROL && (header->flags & (KEEPALIVE_FLAG | ACK_FLAG)) == KEEPALIVE_FLAG &&
+           header->conn_id == sockfd->conn_id;
+}
+
+
+//advertises what the kernel receive buffer holds, at least a full segment
+static void update_recv_window(RUDP_Socket *sockfd) {
+    Util_Tuning effective;
+    sockfd->recv_window = util_tuning_effective(sockfd->socket_fd, &effective) == 0 ? (uint32_t)effective.rcvbuf : 0;
+    if (sockfd->recv_window < RUDP_MAX_DATA) {
+        sockfd->recv_window = RUDP_MAX_DATA;
+    }
+}
+
+//a dual-stack IPv6 socket, which reaches IPv4 peers through v4-mapped addresses, or plain IPv4 where the host has no IPv6
+static int open_udp_socket(int *family) {
+    int sockfd = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+    if (sockfd >= 0) {
+        int v6only = 0;
+        if (setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) == 0) {
+            *family = AF_INET6;
+            return sockfd;
+        }
+        close(sockfd);
+    }
+    *family = AF_INET;
+    return socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+}
 
 // Allocates a new structure for the RUDP socket
 RUDP_Socket* rudp_socket(bool isServer, unsigned short int listen_port) {
     RUDP_Socket *sock = malloc(sizeof(RUDP_Socket));
     if (sock == NULL) {
         perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+        return NULL;
     }
 
     // Create UDP socket
-    int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int sockfd = open_udp_socket(&sock->family);
     if (sockfd < 0) {
         perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+        free(sock);
+        return NULL;
     }
     sock->socket_fd = sockfd;
     sock->isServer = isServer;
     sock->isConnected = false;
+    sock->send_seq = 1;
+    sock->recv_seq = 1;
+    sock->peer_window = RUDP_MAX_DATA;
+    sock->srtt_us = 0;
+    sock->rttvar_us = 0;
+    sock->rto_us = INITIAL_RTO_US;
+    sock->conn_id = 0;
+    sock->mss = RUDP_MAX_DATA;
+    sock->checksum_type = RUDP_CHECKSUM_RFC1071;
+    sock->offered_mss = sock->mss;
+    sock->offered_checksum = sock->checksum_type;
+    sock->fec_data = 0;
+    sock->fec_parity = 0;
+    sock->offered_fec_data = 0;
+    sock->offered_fec_parity = 0;
+    sock->compression = RUDP_COMPRESSION_NONE;
+    sock->offered_compression = RUDP_COMPRESSION_NONE;
+    memset(&sock->fec, 0, sizeof(sock->fec));
+    memset(sock->reorder, 0, sizeof(sock->reorder));
+    sock->handshake_pending = false;
+    sock->peer_closed = false;
+    sock->send_msg_id = 1;
+    sock->recv_msg_id = 1;
+    sock->linger_us = 0;
+    sock->keepalive_us = 0;
+    sock->idle_timeout_us = 0;
+    sock->last_recv_us = 0;
+    sock->last_probe_us = 0;
+    sock->pacing_rate = 0;
+    sock->kernel_pacing_rate = 0;
+    sock->pace_next_us = 0;
+    sock->timestamping = false;
+    sock->echo_time_us = 0;
+    memset(&sock->stats, 0, sizeof(sock->stats));
+    sock->verify = false;
+    sock->digest_mismatch = false;
+    sock->trace = NULL;
+    sock->resume_token = 0;
+    sock->resume_secret = random_u64() | 1;
+    if (pool_init(&sock->pool, POOL_SEGMENTS) < 0) {
+        perror("Segment pool allocation failed");
+        close(sockfd);
+        free(sock);
+        return NULL;
+    }
+    //from here on rudp_close undoes everything
+
+    //the receive window we advertise is what the kernel buffer can hold
+    Util_Tuning tuning;
+    util_tuning_init(&tuning);
+    tuning.rcvbuf = DEFAULT_RCVBUF;
+    util_tuning_apply(sockfd, &tuning);
+    update_recv_window(sock);
 
 
     // Set SO_REUSEADDR option
     int optval = 1;
     if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
         perror("Setting SO_REUSEADDR option failed");
-        exit(EXIT_FAILURE);
+        rudp_close(sock);
+        return NULL;
     }
 
-    // Server binds to port
+    // Server binds to port, on every address of both families
     if (isServer) {
-        struct sockaddr_in server_addr;
+        struct sockaddr_storage server_addr;
         memset(&server_addr, 0, sizeof(server_addr));
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_addr.s_addr = INADDR_ANY;
-        server_addr.sin_port = htons(listen_port);
+        if (sock->family == AF_INET6) {
+            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&server_addr;
+            addr6->sin6_family = AF_INET6;
+            addr6->sin6_addr = in6addr_any;
+            addr6->sin6_port = htons(listen_port);
+        } else {
+            struct sockaddr_in *addr4 = (struct sockaddr_in *)&server_addr;
+            addr4->sin_family = AF_INET;
+            addr4->sin_addr.s_addr = INADDR_ANY;
+            addr4->sin_port = htons(listen_port);
+        }
 
-        if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        if (bind(sockfd, (struct sockaddr *)&server_addr, addr_size(&server_addr)) < 0) {
             perror("Bind failed");
-            exit(EXIT_FAILURE);
+            rudp_close(sock);
+            return NULL;
         }
     }
     // Check and print socket mode
     int flags = fcntl(sockfd, F_GETFL, 0);
     if (flags == -1) {
         perror("Failed to get socket flags");
-        close(sockfd);
-        free(sock);
-        exit(EXIT_FAILURE);
+        rudp_close(sock);
+        return NULL;
     }
 
     
@@ -91,51 +844,134 @@ RUDP_Socket* rudp_socket(bool isServer, unsigned short int listen_port) {
     return sock;
 }
 
-// Tries to connect to the other side via RUDP
-int rudp_connect(RUDP_Socket *sockfd, const char *dest_ip, unsigned short int dest_port) {
+//looks up the peer's address or host name, in the socket's family: on a dual-stack socket an IPv4 peer becomes v4-mapped
+static int resolve_peer(RUDP_Socket *sockfd, const char *dest_host, unsigned short int dest_port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = sockfd->family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    hints.ai_flags = sockfd->family == AF_INET6 ? AI_V4MAPPED : 0;
+    char port[6];
+    snprintf(port, sizeof(port), "%u", dest_port);
+    struct addrinfo *found = NULL;
+    int err = getaddrinfo(dest_host, port, &hints, &found);
+    if (err != 0) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", dest_host, gai_strerror(err));
+        return -1;
+    }
+    memset(&sockfd->dest_addr, 0, sizeof(sockfd->dest_addr));
+    memcpy(&sockfd->dest_addr, found->ai_addr, found->ai_addrlen);
+    freeaddrinfo(found);
+    return 0;
+}
+
+//sends the SYN, and unless resuming waits for the SYN-ACK, retransmitting the SYN with backoff
+static int start_connection(RUDP_Socket *sockfd, const char *dest_ip, unsigned short int dest_port, const RUDP_Resume *ticket) {
     if (sockfd->isServer || sockfd->isConnected) {
         fprintf(stderr, "Invalid operation: Socket is already connected or set to server.\n");
         return 0;
     }
 
-    sockfd->dest_addr.sin_family = AF_INET;
-    sockfd->dest_addr.sin_addr.s_addr = inet_addr(dest_ip);
-    sockfd->dest_addr.sin_port = htons(dest_port);
+    if (resolve_peer(sockfd, dest_ip, dest_port) < 0) {
+        return 0;
+    }
+    reset_connection_state(sockfd);
 
     // Set SO_REUSEADDR option
     int optval = 1;
     if (setsockopt(sockfd->socket_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
         perror("Setting SO_REUSEADDR option failed");
-        exit(EXIT_FAILURE);
+        return 0;
     }
 
-    // Send SYN packet
+    //a fresh connection ID and initial sequence number, so old or stray packets are not mistaken for ours
+    do {
+        sockfd->conn_id = (uint32_t)random_u64();
+    } while (sockfd->conn_id == 0);
+    sockfd->send_seq = (uint32_t)random_u64();
+
     // Set up the SYN packet and send it to the server
-    struct timeval tv;
-    tv.tv_sec = TIMEOUT_SEC;
-    tv.tv_usec = 0;
-    setsockopt(sockfd->socket_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-
-    RUDPHeader syn_packet;
-    syn_packet.flags = SYN_FLAG;
-    sendto(sockfd->socket_fd, &syn_packet, sizeof(syn_packet), 0, (struct sockaddr *)&(sockfd->dest_addr), sizeof(sockfd->dest_addr));
-
-    // Receive SYN-ACK packet
-    RUDPHeader syn_ack_packet;
-    socklen_t addr_len = sizeof(sockfd->dest_addr);
-    ssize_t bytes_received = recvfrom(sockfd->socket_fd, &syn_ack_packet, sizeof(syn_ack_packet), 0, (struct sockaddr *)&(sockfd->dest_addr), &addr_len);
-    if (bytes_received <= 0 || syn_ack_packet.flags != SYN_ACK_FLAG) {
-        fprintf(stderr, "Connection failed: SYN-ACK not received.\n");
-        return 0;
+    RUDP_Handshake syn_packet;
+    if (ticket != NULL) {
+        //the parameters agreed on last time are used straight away
+        sockfd->mss = ticket->mss;
+        sockfd->checksum_type = ticket->checksum_type;
+        sockfd->fec_data = ticket->fec_data;
+        sockfd->fec_parity = ticket->fec_parity;
+        sockfd->compression = ticket->compression;
+        sockfd->peer_window = ticket->peer_window;
+        build_handshake(sockfd, &syn_packet, SYN_FLAG | RESUME_FLAG, ticket->token);
+        if (send_handshake(sockfd, &syn_packet) < 0) {
+            perror("sendto() failed");
+            return 0;
+        }
+        //the SYN-ACK is picked up later by rudp_send/rudp_recv, which repeat the SYN until it arrives
+        sockfd->handshake_pending = true;
+        connection_established(sockfd);
+        return 1;
     }
 
-    // Send ACK packet
-    RUDPHeader ack_packet;
-    ack_packet.flags = ACK_FLAG;
-    sendto(sockfd->socket_fd, &ack_packet, sizeof(ack_packet), 0, (struct sockaddr *)&(sockfd->dest_addr), sizeof(sockfd->dest_addr));
+    build_handshake(sockfd, &syn_packet, SYN_FLAG, 0);
+    long long timeout_us = INITIAL_RTO_US;
+    for (int attempt = 0; attempt <= HANDSHAKE_RETRIES; attempt++) {
+        long long sent_at = now_us();
+        if (send_handshake(sockfd, &syn_packet) < 0) {
+            perror("sendto() failed");
+            return 0;
+        }
 
-    sockfd->isConnected = true;
-    return 1;
+        // Receive SYN-ACK packet, anything else is ignored
+        long long remaining_us;
+        while ((remaining_us = sent_at + timeout_us - now_us()) > 0) {
+            if (wait_readable(sockfd->socket_fd, remaining_us) <= 0) {
+                continue;
+            }
+            RUDP_Handshake syn_ack_packet;
+            if (recv_control(sockfd, MSG_DONTWAIT, &syn_ack_packet, NULL, NULL) < 0 || syn_ack_packet.header.type != RUDP_TYPE_HANDSHAKE ||
+                !(syn_ack_packet.header.flags & SYN_ACK_FLAG) || syn_ack_packet.header.conn_id != sockfd->conn_id) {
+                continue;
+            }
+            update_rtt(sockfd, now_us() - sent_at);
+
+            // Send ACK packet
+            apply_syn_ack(sockfd, &syn_ack_packet);
+            connection_established(sockfd);
+            return 1;
+        }
+        timeout_us *= 2;
+    }
+
+    fprintf(stderr, "Connection failed: SYN-ACK not received.\n");
+    return 0;
+}
+
+// Tries to connect to the other side via RUDP
+int rudp_connect(RUDP_Socket *sockfd, const char *dest_ip, unsigned short int dest_port) {
+    return start_connection(sockfd, dest_ip, dest_port, NULL);
+}
+
+// Reconnects to a known server, sending data right away
+int rudp_connect_resume(RUDP_Socket *sockfd, const char *dest_ip, unsigned short int dest_port, const RUDP_Resume *ticket) {
+    if (ticket == NULL || ticket->token == 0) {
+        return start_connection(sockfd, dest_ip, dest_port, NULL);
+    }
+    return start_connection(sockfd, dest_ip, dest_port, ticket);
+}
+
+// Copies the ticket for resuming to the connected server
+int rudp_get_resume(RUDP_Socket *sockfd, RUDP_Resume *ticket) {
+    if (sockfd->isServer || !sockfd->isConnected || sockfd->resume_token == 0) {
+        return -1;
+    }
+    ticket->token = sockfd->resume_token;
+    ticket->mss = sockfd->mss;
+    ticket->checksum_type = sockfd->checksum_type;
+    ticket->fec_data = sockfd->fec_data;
+    ticket->fec_parity = sockfd->fec_parity;
+    ticket->compression = sockfd->compression;
+    ticket->peer_window = sockfd->peer_window;
+    return 0;
 }
 
 // Accepts incoming connection request and completes the handshake
@@ -145,107 +981,431 @@ int rudp_accept(RUDP_Socket *sockfd) {
         return 0;
     }
 
-    // Receive SYN packet
-    RUDPHeader syn_packet;
-    socklen_t addr_len = sizeof(sockfd->dest_addr);
-    ssize_t bytes_received = recvfrom(sockfd->socket_fd, &syn_packet, sizeof(syn_packet), 0, (struct sockaddr *)&(sockfd->dest_addr), &addr_len);
-    if (bytes_received <= 0 || syn_packet.flags != SYN_FLAG) {
-        fprintf(stderr, "Connection failed: SYN packet not received.\n");
-        return 0;
+    // Receive SYN packet, stray datagrams are skipped
+    RUDP_Handshake syn_packet;
+    while (1) {
+        //recvfrom shrinks addr_len to the last sender's address, so each wait starts from the full size
+        socklen_t addr_len = sizeof(struct sockaddr_storage);
+        if (recv_control(sockfd, 0, &syn_packet, &sockfd->dest_addr, &addr_len) < 0) {
+            fprintf(stderr, "Connection failed: SYN packet not received.\n");
+            return 0;
+        }
+        if (syn_packet.header.type == RUDP_TYPE_HANDSHAKE && (syn_packet.header.flags & SYN_FLAG) && syn_packet.header.conn_id != 0) {
+            break;
+        }
+    }
+
+    reset_connection_state(sockfd);
+    sockfd->conn_id = syn_packet.header.conn_id;
+    sockfd->recv_seq = syn_packet.isn;
+    sockfd->peer_window = syn_packet.header.window;
+    sockfd->send_seq = (uint32_t)random_u64();
+
+    //a valid token proves we already agreed on these parameters with this peer
+    bool resumed = (syn_packet.header.flags & RESUME_FLAG) &&
+                   syn_packet.resume_token == resume_token_for(sockfd, &sockfd->dest_addr, &syn_packet);
+    if (resumed) {
+        sockfd->mss = syn_packet.mss;
+        sockfd->checksum_type = syn_packet.checksum_type;
+        sockfd->fec_data = syn_packet.fec_data;
+        sockfd->fec_parity = syn_packet.fec_parity;
+        sockfd->compression = syn_packet.compression;
+    } else {
+        if (syn_packet.mss < sockfd->mss && syn_packet.mss > 0) {
+            sockfd->mss = syn_packet.mss;
+        }
+        if (syn_packet.checksum_type == RUDP_CHECKSUM_RFC1071) {
+            sockfd->checksum_type = RUDP_CHECKSUM_RFC1071;
+        }
+        if (syn_packet.compression == RUDP_COMPRESSION_LZ) {
+            sockfd->compression = RUDP_COMPRESSION_LZ;
+        }
+        //the higher share of parity wins, no FEC counts as none in one
+        unsigned int ours = sockfd->fec_parity * (syn_packet.fec_data > 0 ? syn_packet.fec_data : 1);
+        unsigned int theirs = syn_packet.fec_parity * (sockfd->fec_data > 0 ? sockfd->fec_data : 1);
+        if (theirs > ours && syn_packet.fec_parity <= FEC_MAX_PARITY && syn_packet.fec_parity <= syn_packet.fec_data &&
+            syn_packet.fec_data <= FEC_MAX_DATA) {
+            sockfd->fec_data = syn_packet.fec_data;
+            sockfd->fec_parity = syn_packet.fec_parity;
+        }
+    }
+
+    // Send SYN-ACK packet with a token for resuming next time
+    RUDP_Handshake syn_ack_packet;
+    build_handshake(sockfd, &syn_ack_packet, SYN_ACK_FLAG | (resumed ? RESUME_FLAG : 0), 0);
+    syn_ack_packet.resume_token = resume_token_for(sockfd, &sockfd->dest_addr, &syn_ack_packet);
+    long long sent_at = now_us();
+    if (send_handshake(sockfd, &syn_ack_packet) < 0) {
+        perror("sendto() failed");
+        return 0;
+    }
+
+    //the client is already sending data, there is nothing to wait for
+    if (resumed) {
+        connection_established(sockfd);
+        return 1;
+    }
+
+    // Wait for the ACK, the client's first data segment or ACK proves it got the SYN-ACK as well
+    long long timeout_us = INITIAL_RTO_US;
+    int attempts = 0;
+    bool established = false;
+    while (!established) {
+        long long remaining_us = sent_at + timeout_us - now_us();
+        if (remaining_us <= 0) {
+            if (++attempts > HANDSHAKE_RETRIES) {
+                break;
+            }
+            //back off and repeat the SYN-ACK
+            timeout_us *= 2;
+            sent_at = now_us();
+            send_handshake(sockfd, &syn_ack_packet);
+            continue;
+        }
+        if (wait_readable(sockfd->socket_fd, remaining_us) <= 0) {
+            continue;
+        }
+
+        //peek first so that a data segment stays queued for rudp_recv
+        RUDP_Handshake control;
+        if (recv_control(sockfd, MSG_PEEK | MSG_DONTWAIT, &control, NULL, NULL) < 0) {
+            continue;
+        }
+        if (control.header.type == RUDP_TYPE_DATA && control.header.conn_id == sockfd->conn_id) {
+            break;
+        }
+        recv_control(sockfd, MSG_DONTWAIT, &control, NULL, NULL);
+
+        if (control.header.type == RUDP_TYPE_CONTROL && (control.header.flags & ACK_FLAG) && control.header.conn_id == sockfd->conn_id) {
+            established = true;
+        }
+        //the client repeated its SYN, so our SYN-ACK was lost
+        if (control.header.type == RUDP_TYPE_HANDSHAKE && (control.header.flags & SYN_FLAG) && control.header.conn_id == sockfd->conn_id) {
+            send_handshake(sockfd, &syn_ack_packet);
+        }
+    }
+
+    if (attempts > HANDSHAKE_RETRIES) {
+        fprintf(stderr, "Connection failed: ACK packet not received.\n");
+        return 0;
+    }
+
+    connection_established(sockfd);
+    return 1;
+}
+
+// Sets the largest data payload per segment offered in the handshake
+int rudp_set_mss(RUDP_Socket *sockfd, unsigned short int mss) {
+    if (sockfd->isConnected || mss == 0 || mss > RUDP_MAX_DATA) {
+        return -1;
+    }
+    sockfd->offered_mss = mss;
+    return 0;
+}
+
+// Sets the checksum type asked for in the handshake
+int rudp_set_checksum(RUDP_Socket *sockfd, int checksum_type) {
+    if (sockfd->isConnected || (checksum_type != RUDP_CHECKSUM_NONE && checksum_type != RUDP_CHECKSUM_RFC1071)) {
+        return -1;
+    }
+    sockfd->offered_checksum = (uint8_t)checksum_type;
+    return 0;
+}
+
+// Sets the payload compression asked for in the handshake
+int rudp_set_compression(RUDP_Socket *sockfd, int compression) {
+    if (sockfd->isConnected || (compression != RUDP_COMPRESSION_NONE && compression != RUDP_COMPRESSION_LZ)) {
+        return -1;
+    }
+    sockfd->offered_compression = (uint8_t)compression;
+    return 0;
+}
+
+// Sets the forward error correction asked for in the handshake
+int rudp_set_fec(RUDP_Socket *sockfd, unsigned int data_segments, unsigned int parity_segments) {
+    if (sockfd->isConnected || parity_segments > FEC_MAX_PARITY || data_segments > FEC_MAX_DATA ||
+        parity_segments > data_segments || (parity_segments == 0) != (data_segments == 0)) {
+        return -1;
+    }
+    sockfd->offered_fec_data = (uint8_t)data_segments;
+    sockfd->offered_fec_parity = (uint8_t)parity_segments;
+    return 0;
+}
+
+// Sends a digest with every message from the next one on
+int rudp_set_verify(RUDP_Socket *sockfd, bool enable) {
+    sockfd->verify = enable;
+    return 0;
+}
+
+//XORs length bytes of src into dst, a word at a time
+static void xor_into(char *dst, const char *src, unsigned int length) {
+    unsigned int i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < length; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+//adds a segment to the XOR of its group: the data, its lengths, its end-of-message, compression and digest bits and the digest, the sum starts out zeroed
+static int fec_add_to_group(RUDP_Socket *sockfd, Segment **sum, const RUDP_Packet *packet, unsigned int length) {
+    if (*sum == NULL) {
+        *sum = pool_get(&sockfd->pool);
+        if (*sum == NULL) {
+            return -1;
+        }
+        memset((*sum)->packet.data, 0, sockfd->mss);
+        (*sum)->packet.header.length = 0;
+        (*sum)->packet.header.raw_length = 0;
+        (*sum)->packet.header.flags = 0;
+        (*sum)->packet.header.echo_time_us = 0;
+    }
+    xor_into((*sum)->packet.data, packet->data, length);
+    (*sum)->packet.header.length ^= packet->header.length;
+    (*sum)->packet.header.raw_length ^= packet->header.raw_length;
+    (*sum)->packet.header.flags ^= packet->header.flags & (EOM_FLAG | COMPRESSED_FLAG | DIGEST_FLAG);
+    (*sum)->packet.header.echo_time_us ^= packet->header.echo_time_us;
+    return 0;
+}
+
+//drops every segment held past a gap
+static void reorder_release(RUDP_Socket *sockfd) {
+    for (int i = 0; i < REORDER_SEGMENTS; i++) {
+        if (sockfd->reorder[i] != NULL) {
+            pool_put(&sockfd->pool, sockfd->reorder[i]);
+            sockfd->reorder[i] = NULL;
+        }
+    }
+}
+
+//the next expected segment if it arrived early or was rebuilt, handed over to the caller
+static Segment *reorder_take(RUDP_Socket *sockfd) {
+    Segment **slot = &sockfd->reorder[sockfd->recv_seq & REORDER_MASK];
+    Segment *segment = *slot;
+    if (segment == NULL || segment->packet.seq_num != sockfd->recv_seq) {
+        return NULL;
+    }
+    *slot = NULL;
+    return segment;
+}
+
+static int fec_accept(RUDP_Socket *sockfd, Segment *segment);
+
+//starts the FEC block at the expected segment, counting what the reorder ring already holds of it
+static void fec_start_block(RUDP_Socket *sockfd) {
+    FecBlock *block = &sockfd->fec;
+    for (int j = 0; j < FEC_MAX_PARITY; j++) {
+        if (block->group_sum[j] != NULL) {
+            pool_put(&sockfd->pool, block->group_sum[j]);
+            block->group_sum[j] = NULL;
+        }
+    }
+    block->start = sockfd->recv_seq;
+    block->length = 0;
+    block->received = 0;
+    block->parity_seen = 0;
+    for (uint32_t i = 0; i < sockfd->fec_data; i++) {
+        Segment *held = sockfd->reorder[(block->start + i) & REORDER_MASK];
+        if (held != NULL && held->packet.seq_num == block->start + i) {
+            fec_accept(sockfd, held);
+        }
+    }
+}
+
+//once a group's parity arrived and exactly one of its segments is missing, the group's XOR is that segment
+static void fec_rebuild(RUDP_Socket *sockfd, unsigned int group) {
+    FecBlock *block = &sockfd->fec;
+    if (!(block->parity_seen & (1u << group))) {
+        return;
+    }
+    int missing = -1;
+    for (uint32_t i = group; i < block->length; i += sockfd->fec_parity) {
+        if (!(block->received & (1u << i))) {
+            if (missing >= 0) {
+                return;
+            }
+            missing = (int)i;
+        }
+    }
+    Segment *sum = block->group_sum[group];
+    block->group_sum[group] = NULL;
+    if (missing < 0 || sum->packet.header.length > sockfd->mss) {
+        pool_put(&sockfd->pool, sum);
+        return;
+    }
+    sum->packet.seq_num = block->start + missing;
+    sum->packet.header.msg_id = sockfd->recv_msg_id;
+    trace_event(sockfd, RUDP_TRACE_FEC_REBUILD, RUDP_TRACE_REASON_NONE, sum->packet.seq_num, sum->packet.header.length, 0, 0);
+    sockfd->reorder[sum->packet.seq_num & REORDER_MASK] = sum;
+    block->received |= 1u << missing;
+}
+
+//counts a verified data segment of the current block, returns -1 when it is outside of it
+static int fec_accept(RUDP_Socket *sockfd, Segment *segment) {
+    FecBlock *block = &sockfd->fec;
+    uint32_t index = segment->packet.seq_num - block->start;
+    if (index >= sockfd->fec_data || (block->length > 0 && index >= block->length) || (block->received & (1u << index))) {
+        return -1;
+    }
+    unsigned int group = index % sockfd->fec_parity;
+    if (fec_add_to_group(sockfd, &block->group_sum[group], &segment->packet, segment->packet.header.length) < 0) {
+        return -1;
+    }
+    block->received |= 1u << index;
+    fec_rebuild(sockfd, group);
+    return 0;
+}
+
+//takes in a parity of the current block
+static void fec_add_parity(RUDP_Socket *sockfd, RUDP_Packet *packet) {
+    FecBlock *block = &sockfd->fec;
+    unsigned int group = packet->header.window;
+    if (packet->seq_num != block->start || packet->header.msg_id != sockfd->recv_msg_id || group >= sockfd->fec_parity ||
+        packet->header.ack_num == 0 || packet->header.ack_num > sockfd->fec_data || (block->parity_seen & (1u << group)) ||
+        packet->header.checksum != segment_checksum(sockfd, &packet->header, packet->seq_num, packet->data, sockfd->mss)) {
+        return;
+    }
+    if (fec_add_to_group(sockfd, &block->group_sum[group], packet, sockfd->mss) < 0) {
+        return;
+    }
+    block->length = packet->header.ack_num;
+    block->parity_seen |= 1u << group;
+    fec_rebuild(sockfd, group);
+}
+
+//after a delivered segment: moves on to the next block once the expected segment is past the current one
+static void fec_advance(RUDP_Socket *sockfd) {
+    if (sockfd->fec_data > 0 && sockfd->recv_seq - sockfd->fec.start >= sockfd->fec_data) {
+        fec_start_block(sockfd);
+    }
+}
+
+//hands an in-order segment to the callback and moves the expected sequence number on, returns the data bytes delivered,
+//-1 when the consumer aborted or SEGMENT_CORRUPT for a compressed segment that does not decompress, which is not delivered
+static int deliver_segment(RUDP_Socket *sockfd, RUDP_Packet *packet, rudp_deliver_cb deliver, void *ctx, unsigned long long *capacity) {
+    char *data = packet->data;
+    int length = packet->header.length;
+    if (packet->header.flags & COMPRESSED_FLAG) {
+        length = rudp_decompress(packet->data, packet->header.length, sockfd->codec_buffer, sizeof(sockfd->codec_buffer));
+        if (length != packet->header.raw_length) {
+            sockfd->stats.corrupt_segments++;
+            return SEGMENT_CORRUPT;
+        }
+        data = sockfd->codec_buffer;
+    }
+
+    //a verified message is hashed as it is delivered, its last segment says what the sender hashed
+    if (packet->header.flags & DIGEST_FLAG) {
+        util_digest_update(&sockfd->recv_digest, data, length);
+        if (packet->header.flags & EOM_FLAG) {
+            if (util_digest_final(&sockfd->recv_digest) == packet->header.echo_time_us) {
+                sockfd->stats.verified_messages++;
+            } else {
+                sockfd->stats.digest_mismatches++;
+                sockfd->digest_mismatch = true;
+            }
+        }
     }
 
-    // Send SYN-ACK packet
-    RUDPHeader syn_ack_packet;
-    syn_ack_packet.flags = SYN_ACK_FLAG;
-    sendto(sockfd->socket_fd, &syn_ack_packet, sizeof(syn_ack_packet), 0, (struct sockaddr *)&(sockfd->dest_addr), sizeof(sockfd->dest_addr));
+    //the ACK is only sent once the data was consumed, so a slow consumer holds the sender back
+    if (length > 0 && deliver(ctx, data, length) < 0) {
+        fprintf(stderr, "Receiver aborted the stream.\n");
+        return -1;
+    }
+    *capacity -= length;
+    sockfd->recv_seq++;
+    fec_advance(sockfd);
+    return length;
+}
 
-    // Receive ACK packet
-    RUDPHeader ack_packet;
-    bytes_received = recvfrom(sockfd->socket_fd, &ack_packet, sizeof(ack_packet), 0, (struct sockaddr *)&(sockfd->dest_addr), &addr_len);
-    if (bytes_received <= 0 || ack_packet.flags != ACK_FLAG) {
-        fprintf(stderr, "Connection failed: ACK packet not received.\n");
-        return 0;
+//folds a sample into a running average with a gain of 1/8, the first sample starts it
+static void smooth(long long *average, long long sample, unsigned long long count) {
+    *average = count == 1 ? sample : *average + (sample - *average) / 8;
+}
+
+//measures the one-way delay of a data segment from its send timestamp and when it arrived
+static void record_delay(RUDP_Socket *sockfd, const RUDPHeader *header, const Arrival *arrival) {
+    if (header->send_time_us == 0) {
+        return;
+    }
+    RUDP_Stats *stats = &sockfd->stats;
+    long long arrived_us = arrival->user_us;
+    if (arrival->kernel_us != 0) {
+        stats->kernel_samples++;
+        smooth(&stats->kernel_to_user_us, arrival->user_us - arrival->kernel_us, stats->kernel_samples);
+        arrived_us = arrival->kernel_us;
+        //the card's clock is not the system clock, it only says how long the kernel took when the two are synchronized
+        if (arrival->hardware_us != 0) {
+            stats->hardware_samples++;
+            smooth(&stats->nic_to_kernel_us, arrival->kernel_us - arrival->hardware_us, stats->hardware_samples);
+        }
     }
 
-    sockfd->isConnected = true;
-    return 1;
+    long long owd_us = arrived_us - (long long)header->send_time_us;
+    if (stats->samples == 0) {
+        stats->owd_min_us = owd_us;
+        stats->owd_max_us = owd_us;
+    } else {
+        //RFC 3550: the change in transit time between consecutive segments, smoothed with a gain of 1/16
+        long long change = owd_us - stats->owd_us;
+        if (change < 0) {
+            change = -change;
+        }
+        stats->jitter_us += (change - stats->jitter_us) / 16;
+        if (owd_us < stats->owd_min_us) {
+            stats->owd_min_us = owd_us;
+        }
+        if (owd_us > stats->owd_max_us) {
+            stats->owd_max_us = owd_us;
+        }
+    }
+    stats->owd_us = owd_us;
+    stats->samples++;
 }
 
-int rudp_recv(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size) {
+//receives one message, advertising no more window than capacity bytes
+static long long recv_message(RUDP_Socket *sockfd, rudp_deliver_cb deliver, void *ctx, unsigned long long capacity) {
+    //a peer that already disconnected is reported the same way every time
+    if (!sockfd->isConnected && sockfd->peer_closed) {
+        return RUDP_PEER_CLOSED;
+    }
+
     //if there is no connection
     if (!sockfd->isConnected) {
         fprintf(stderr, "Invalid operation: Socket is not connected.\n");
         return -1;
     }
-    
-
-    struct sockaddr_in sender_addr;
-    socklen_t sender_len = sizeof(sender_addr);
-    int total_bytes_received = 0;
-    unsigned int total_data_bytes_received = 0;
-    
-    //check sequance number
-    uint32_t expected_seq_number = 1;
-    
-
-    while(1){
-        //check if we are waiting for the last packet that have less data bytes then the others.
-        if(expected_seq_number == 33){
-            RUDP_LAST_PACKET lpacket;
-            int bytes_received = recvfrom(sockfd->socket_fd, &lpacket, sizeof(RUDP_LAST_PACKET), 0, (struct sockaddr *)&sender_addr, &sender_len);
-            if (bytes_received < 0) {
-                perror("recvfrom");
-                return -1;
-            }
-
-            if(expected_seq_number != lpacket.seq_num){
-                fprintf(stderr, "Invalid sequence number. Expected: %d, Received: %d\n", expected_seq_number, lpacket.seq_num);
-                return -1;
-            }
-
-            // Extract header information
-            unsigned short int received_checksum = lpacket.header.checksum;
-            lpacket.header.checksum = 0; // Reset checksum field before calculating checksum
-            unsigned short int calculated_checksum = calculate_checksum(lpacket.data, lpacket.header.length);
-
-            // Verify checksum
-            if (received_checksum != calculated_checksum) {
-                fprintf(stderr, "Checksum verification failed.\n");
-                return -1;
-            }
-
-            if (buffer == NULL) {
-                fprintf(stderr, "Buffer pointer is null\n");
-                return -1;
-            }
-
-            if ((unsigned int)(total_data_bytes_received + lpacket.header.length) > buffer_size) {
-                printf("Buffer overflow prevented. Total bytes so far: %d, Current packet size: %d, Buffer size: %d\n", total_bytes_received, lpacket.header.length, buffer_size);
-                return -1;
-            }
-
-            memcpy((char *)buffer + total_data_bytes_received, lpacket.data, lpacket.header.length);
-
-
-            // Send ACK back to the sender
-            RUDPHeader ack_packet;
-            ack_packet.flags = ACK_FLAG;
-            sendto(sockfd->socket_fd, &ack_packet, sizeof(ack_packet), 0, (struct sockaddr *)&sender_addr, sender_len);
-            
-            total_bytes_received = total_bytes_received + bytes_received;
-            total_data_bytes_received = total_data_bytes_received + lpacket.header.length;
-            
-            expected_seq_number = 0;
-
-            if(total_data_bytes_received == buffer_size){
-                fprintf(stderr, "Received enough bytes\n");
-                break;
-            }
 
+    if (deliver == NULL) {
+        fprintf(stderr, "Deliver callback is null\n");
+        return -1;
+    }
 
-        }
-        //for all the packets before the last
+    struct sockaddr_storage sender_addr;
+    socklen_t sender_len;
+    long long total_data_bytes_received = 0;
+    long long result = -1;
+    bool message_started = false;
 
+    Segment *segment = pool_get(&sockfd->pool);
+    if (segment == NULL) {
+        fprintf(stderr, "No free segment buffer\n");
+        return -1;
+    }
+    RUDP_Packet *packet = &segment->packet;
+    reorder_release(sockfd);
+    fec_start_block(sockfd);
+    util_digest_init(&sockfd->recv_digest, 0);
+    sockfd->digest_mismatch = false;
+
+    bool complete = false;
+    while(!complete){
         //trying to set to blocking mode
         int flags = fcntl(sockfd->socket_fd, F_GETFL, 0);
         if (flags & O_NONBLOCK) {
@@ -254,69 +1414,299 @@ int rudp_recv(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size) {
             fcntl(sockfd->socket_fd, F_SETFL, flags);
         }
 
+        //block until a packet arrives, waking up for the keepalive and idle timers
+        long long deadline = timer_deadline(sockfd, -1);
+        if (deadline >= 0) {
+            int ready = wait_readable(sockfd->socket_fd, deadline - now_us());
+            if (ready < 0 && errno != EINTR) {
+                perror("poll() failed");
+                goto done;
+            }
+            if (ready <= 0) {
+                if (run_timers(sockfd) < 0) {
+                    goto done;
+                }
+                continue;
+            }
+        }
+
         // Receive the packet
-        RUDP_Packet packet;
-        int bytes_received = recvfrom(sockfd->socket_fd, &packet, sizeof(RUDP_Packet), 0, (struct sockaddr *)&sender_addr, &sender_len);
-        if (bytes_received < 0) {
+        Arrival arrival;
+        sender_len = sizeof(sender_addr);
+        ssize_t payload_size = recv_datagram(sockfd, 0, &packet->header, &packet->seq_num, packet->data, RUDP_MAX_DATA, &sender_addr, &sender_len, &arrival);
+        if (payload_size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             perror("recvfrom");
-            return -1;
+            goto done;
+        }
+        uint8_t type = packet->header.type;
+        if (type != RUDP_TYPE_NONE && packet->header.conn_id == sockfd->conn_id) {
+            sockfd->last_recv_us = now_us();
+        }
+        //not RUDP, or not for this connection: dropped without an answer, whoever sent it cannot disturb the connection
+        if (type == RUDP_TYPE_NONE || (packet->header.conn_id != sockfd->conn_id && type != RUDP_TYPE_HANDSHAKE)) {
+            sockfd->stats.unexpected_packets++;
+            continue;
         }
-        
 
+        //control packets carry no data, only a late handshake, a keepalive probe or a FIN needs an answer
+        if (is_probe(sockfd, &packet->header)) {
+            send_ack(sockfd, &sender_addr, capacity, KEEPALIVE_FLAG);
+            continue;
+        }
+        if (type == RUDP_TYPE_HANDSHAKE) {
+            RUDP_Handshake handshake;
+            handshake.header = packet->header;
+            handshake.isn = packet->seq_num;
+            decode_handshake_body((unsigned char *)packet->data, &handshake);
+            handle_late_handshake(sockfd, &handshake);
+        }
+        if (type == RUDP_TYPE_CONTROL && is_peer_fin(sockfd, &packet->header)) {
+            accept_peer_fin(sockfd);
+            if (message_started) {
+                fprintf(stderr, "Peer closed the connection in the middle of a message.\n");
+                goto done;
+            }
+            //no message, the session is over
+            result = RUDP_PEER_CLOSED;
+            goto done;
+        }
+        if (type != RUDP_TYPE_DATA || packet->header.conn_id != sockfd->conn_id) {
+            continue;
+        }
 
-        //if the sequance numbers are different
-        if(expected_seq_number != packet.seq_num){
-            fprintf(stderr, "Invalid sequence number. Expected: %d, Received: %d\n", expected_seq_number, packet.seq_num);
-            return -1;
+        //a parity's length is the XOR of its group's lengths and may be anything, fec_rebuild checks the rebuilt one
+        if (!(packet->header.flags & FEC_FLAG) && packet->header.length > RUDP_MAX_DATA) {
+            sockfd->stats.corrupt_segments++;
+            continue;
         }
+        record_delay(sockfd, &packet->header, &arrival);
 
-        // Extract header information
-        unsigned short int received_checksum = packet.header.checksum;
-        packet.header.checksum = 0; // Reset checksum field before calculating checksum
-        unsigned short int calculated_checksum = calculate_checksum(packet.data, packet.header.length);
+        //a parity may rebuild the lost segment the data path is waiting for
+        if (packet->header.flags & FEC_FLAG) {
+            if (sockfd->fec_data > 0 && payload_size == sockfd->mss) {
+                fec_add_parity(sockfd, packet);
+            }
+        } else if (sockfd->recv_seq != packet->seq_num) {
+            //a segment past a gap waits in the reorder ring, one behind the expected segment (wrapping to a huge distance) is a duplicate
+            uint32_t ahead = packet->seq_num - sockfd->recv_seq;
+            Segment **slot = &sockfd->reorder[packet->seq_num & REORDER_MASK];
+            Segment *spare;
+            bool intact = packet->header.length <= sockfd->mss &&
+                          packet->header.checksum == segment_checksum(sockfd, &packet->header, packet->seq_num, packet->data, packet->header.length);
+            if (!intact) {
+                sockfd->stats.corrupt_segments++;
+            }
+            if (ahead < REORDER_SEGMENTS && *slot == NULL && packet->header.msg_id == sockfd->recv_msg_id && intact &&
+                (spare = pool_get(&sockfd->pool)) != NULL) {
+                trace_event(sockfd, RUDP_TRACE_RECV, RUDP_TRACE_REASON_HELD, packet->seq_num, packet->header.length, capacity, 0);
+                *slot = segment;
+                if (sockfd->fec_data > 0) {
+                    fec_accept(sockfd, segment);
+                }
+                segment = spare;
+                packet = &segment->packet;
+            } else {
+                trace_event(sockfd, RUDP_TRACE_RECV, RUDP_TRACE_REASON_DISCARDED, packet->seq_num, packet->header.length, capacity, 0);
+            }
+        } else if (packet->header.msg_id != sockfd->recv_msg_id) {
+            //the expected sequence number in another message is a forged or mangled segment
+            sockfd->stats.unexpected_packets++;
+            trace_event(sockfd, RUDP_TRACE_RECV, RUDP_TRACE_REASON_DISCARDED, packet->seq_num, packet->header.length, capacity, 0);
+        } else if (packet->header.checksum != segment_checksum(sockfd, &packet->header, packet->seq_num, packet->data, packet->header.length)) {
+            //dropped like a lost segment, the repeated ACK below gets it resent
+            sockfd->stats.corrupt_segments++;
+            trace_event(sockfd, RUDP_TRACE_RECV, RUDP_TRACE_REASON_DISCARDED, packet->seq_num, packet->header.length, capacity, 0);
+        } else {
+            if (sockfd->fec_data > 0) {
+                fec_accept(sockfd, segment);
+            }
+            trace_event(sockfd, RUDP_TRACE_RECV, RUDP_TRACE_REASON_IN_ORDER, packet->seq_num, packet->header.length, capacity, 0);
+            //our ACKs echo the segment that filled the gap, not the ones that waited for it
+            sockfd->echo_time_us = packet->header.send_time_us;
+            int delivered = deliver_segment(sockfd, packet, deliver, ctx, &capacity);
+            if (delivered == SEGMENT_CORRUPT) {
+                //the FEC block already counted it, so it starts over from what the reorder ring holds
+                fec_start_block(sockfd);
+            } else if (delivered < 0) {
+                goto done;
+            } else {
+                total_data_bytes_received += delivered;
+                message_started = true;
+                complete = (packet->header.flags & EOM_FLAG) != 0;
+            }
+        }
 
-        // Verify checksum
-        if (received_checksum != calculated_checksum) {
-            fprintf(stderr, "Checksum verification failed.\n");
-            return -1;
+        //segments that arrived early or were rebuilt follow in order
+        Segment *next;
+        while (!complete && (next = reorder_take(sockfd)) != NULL) {
+            int delivered = deliver_segment(sockfd, &next->packet, deliver, ctx, &capacity);
+            complete = delivered >= 0 && (next->packet.header.flags & EOM_FLAG) != 0;
+            pool_put(&sockfd->pool, next);
+            if (delivered == SEGMENT_CORRUPT) {
+                fec_start_block(sockfd);
+                break;
+            }
+            if (delivered < 0) {
+                goto done;
+            }
+            total_data_bytes_received += delivered;
+            message_started = true;
         }
 
-        if (buffer == NULL) {
-            fprintf(stderr, "Buffer pointer is null\n");
-            return -1;
+        //the last segment of the message, the whole window is free again for the next one
+        if (complete) {
+            sockfd->recv_msg_id++;
+            reorder_release(sockfd);
+            fec_start_block(sockfd);
+            send_ack(sockfd, &sender_addr, sockfd->recv_window, 0);
+        } else {
+            //also repeats our ACK after a duplicate or a gap, so the sender retransmits
+            send_ack(sockfd, &sender_addr, capacity, 0);
         }
+    }
+
+    //return how much data bytes the function received
+    result = total_data_bytes_received;
+    if (sockfd->digest_mismatch) {
+        fprintf(stderr, "Message digest mismatch, the data received is not what was sent.\n");
+        result = -1;
+    }
+
+done:
+    reorder_release(sockfd);
+    fec_start_block(sockfd);
+    pool_put(&sockfd->pool, segment);
+    return result;
+}
+
+// Receives one message and hands its data to the callback as the segments arrive in order
+long long rudp_recv_stream(RUDP_Socket *sockfd, rudp_deliver_cb deliver, void *ctx) {
+    return recv_message(sockfd, deliver, ctx, ~0ULL);
+}
 
-        if ((unsigned int)(total_data_bytes_received + packet.header.length) > buffer_size) {
-            printf("Buffer overflow prevented. Total bytes so far: %d, Current packet size: %d, Buffer size: %d\n", total_bytes_received, packet.header.length, buffer_size);
+//sends a segment that is already filled in and stamps its send time
+static int send_segment(RUDP_Socket *sockfd, Segment *slot) {
+    RUDPHeader *header = &slot->packet.header;
+    header->type = RUDP_TYPE_DATA;
+    header->send_time_us = (uint64_t)wall_us();
+    //only the data is sent, a parity always covers a full segment
+    size_t payload_size = (header->flags & FEC_FLAG) ? sockfd->mss : header->length;
+    //the checksum covers the header, so it is taken again for every transmission's send time
+    header->checksum = segment_checksum(sockfd, header, slot->packet.seq_num, slot->packet.data, payload_size);
+    if (send_datagram(sockfd, header, slot->packet.seq_num, slot->packet.data, payload_size, &sockfd->dest_addr) < 0) {
+        //a full queue loses the segment like the network would, the retransmission repairs it
+        if (errno != ENOBUFS && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("sendto() failed");
             return -1;
         }
+        sockfd->stats.send_errors++;
+    }
+    slot->sent_at = now_us();
+    return 0;
+}
 
-        memcpy((char *)buffer + total_data_bytes_received, packet.data, packet.header.length);
+//the rate segments leave at: the fixed rate, or our full window per smoothed RTT, 0 before the first RTT sample.
+//the peer's advertised window is left out, it only limits what is in flight and may be a few bytes after a small rudp_recv.
+static unsigned long long current_pacing_rate(RUDP_Socket *sockfd) {
+    if (sockfd->pacing_rate > 0) {
+        return sockfd->pacing_rate;
+    }
+    if (sockfd->srtt_us == 0) {
+        return 0;
+    }
+    unsigned long long window = (unsigned long long)SEND_WINDOW_SEGMENTS * sockfd->mss;
+    return window * 1000000ULL / sockfd->srtt_us * PACING_GAIN_PERCENT / 100;
+}
 
+//hands the rate to the kernel as well, an fq qdisc then spaces the packets on the wire
+static void update_kernel_pacing(RUDP_Socket *sockfd, unsigned long long rate) {
+    unsigned long long last = sockfd->kernel_pacing_rate;
+    if (rate == last || (last > 0 && rate > last - last / 8 && rate < last + last / 8)) {
+        return;
+    }
+    unsigned int value = (rate == 0 || rate > 0xffffffffULL) ? 0xffffffffU : (unsigned int)rate;
+    setsockopt(sockfd->socket_fd, SOL_SOCKET, SO_MAX_PACING_RATE, &value, sizeof(value));
+    sockfd->kernel_pacing_rate = rate;
+    trace_event(sockfd, RUDP_TRACE_RATE, RUDP_TRACE_REASON_NONE, 0, 0, 0, rate);
+}
 
-        // Send ACK back to the sender
-        RUDPHeader ack_packet;
-        ack_packet.flags = ACK_FLAG;
-        sendto(sockfd->socket_fd, &ack_packet, sizeof(ack_packet), 0, (struct sockaddr *)&sender_addr, sender_len);
-        
-        total_bytes_received = total_bytes_received + bytes_received;
-        total_data_bytes_received = total_data_bytes_received + packet.header.length;
-        
-        //update the expected sequance number
-        expected_seq_number++;
-
-        //enough byte received
-        if(total_data_bytes_received == buffer_size){
-            break;
-        }
+//moves the departure time of the next segment on by the time this one takes at the pacing rate
+static void pace_segment(RUDP_Socket *sockfd, unsigned long long rate, unsigned int length) {
+    if (rate == 0) {
+        return;
+    }
+    long long now = now_us();
+    if (sockfd->pace_next_us < now - PACING_BURST_US) {
+        sockfd->pace_next_us = now - PACING_BURST_US;
+    }
+    sockfd->pace_next_us += (long long)((unsigned long long)(length + RUDP_WIRE_HEADER_SIZE) * 1000000ULL / rate);
+}
+
+//sends a segment again out of turn, it gives no RTT sample any more
+static int retransmit_segment(RUDP_Socket *sockfd, Segment *segment, unsigned long long rate, uint16_t reason) {
+    segment->retransmitted = true;
+    if (send_segment(sockfd, segment) < 0) {
+        return -1;
+    }
+    trace_event(sockfd, RUDP_TRACE_RETRANSMIT, reason, segment->packet.seq_num, segment->packet.header.length, sockfd->peer_window, 0);
+    pace_segment(sockfd, rate, segment->packet.header.length);
+    return 0;
+}
+
+//pulls the next segment's data from the callback and compresses it if the connection negotiated it, returns the data bytes or 0 at the end of the message
+static int fill_segment(RUDP_Socket *sockfd, rudp_fill_cb fill, void *ctx, Segment *segment) {
+    RUDPHeader *header = &segment->packet.header;
+    int data_size = fill(ctx, segment->packet.data, sockfd->mss);
+    header->flags = sockfd->verify ? DIGEST_FLAG : 0;
+    header->length = data_size > 0 ? data_size : 0;
+    header->raw_length = header->length;
+    header->echo_time_us = 0;
+    if (sockfd->verify && data_size > 0) {
+        util_digest_update(&sockfd->send_digest, segment->packet.data, data_size);
+    }
+    if (data_size <= 0 || sockfd->compression != RUDP_COMPRESSION_LZ) {
+        return data_size;
     }
+    //a segment that does not shrink is stored as it is
+    int compressed = rudp_compress(segment->packet.data, data_size, sockfd->codec_buffer, data_size - 1);
+    if (compressed > 0) {
+        memcpy(segment->packet.data, sockfd->codec_buffer, compressed);
+        header->length = compressed;
+        header->flags |= COMPRESSED_FLAG;
+    }
+    return data_size;
+}
 
-    //return how much byte the function received
-    return total_bytes_received;    
+//sends the parities of a finished block, they are never retransmitted
+static int fec_send_parity(RUDP_Socket *sockfd, Segment **parity, uint32_t block_start, uint32_t block_length, unsigned long long rate) {
+    int result = 0;
+    for (unsigned int group = 0; group < sockfd->fec_parity; group++) {
+        Segment *sum = parity[group];
+        if (sum == NULL) {
+            continue;
+        }
+        sum->packet.seq_num = block_start;
+        sum->packet.header.flags |= FEC_FLAG;
+        sum->packet.header.ack_num = block_length;
+        sum->packet.header.window = group;
+        sum->packet.header.conn_id = sockfd->conn_id;
+        sum->packet.header.msg_id = sockfd->send_msg_id;
+        if (result == 0 && send_segment(sockfd, sum) < 0) {
+            result = -1;
+        }
+        trace_event(sockfd, RUDP_TRACE_PARITY, RUDP_TRACE_REASON_NONE, block_start, block_length, 0, group);
+        pace_segment(sockfd, rate, sockfd->mss);
+        pool_put(&sockfd->pool, sum);
+        parity[group] = NULL;
+    }
+    return result;
 }
 
-// Sends data to the other side
-int rudp_send(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size) {
+// Sends one message whose data is pulled from the callback one segment at a time
+long long rudp_send_stream(RUDP_Socket *sockfd, rudp_fill_cb fill, void *ctx) {
     if (sockfd == NULL) {
         fprintf(stderr, "Invalid RUDP socket\n");
         return -1;
@@ -328,215 +1718,514 @@ int rudp_send(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size) {
         return -1;
     }
 
-    //setting the data size of each packet (except the last)
-    int data_in_packet_size = 65400;
-    
-
-    // Calculate the number of packets needed
-    uint32_t numOfPackets = buffer_size / data_in_packet_size;
-
-    // Account for remaining data
-    int remaining_bytes = buffer_size % data_in_packet_size;
-    if (remaining_bytes > 0) {
-        numOfPackets++;
+    if (fill == NULL) {
+        fprintf(stderr, "Fill callback is null\n");
+        return -1;
     }
-    //setting the remaining bytes to be the buffer and we will remove the byte sent each time
-    remaining_bytes = buffer_size;
-
-    // Pointer to track the current position in the buffer
-    char *current_position = (char *)buffer;
-    
-
-    // Loop through each packet
-    for (uint32_t i = 1; i <= numOfPackets-1; i++) {
-        RUDP_Packet packet;
 
-        // Set sequence number
-        packet.seq_num = i;
+    //the segments in flight plus the one read ahead, so the last segment can be flagged
+#define SLOT(seq) (sockfd->send_window[(uint32_t)((seq) - first_seq) % (SEND_WINDOW_SEGMENTS + 1)])
+
+    uint32_t first_seq = sockfd->send_seq;
+    uint32_t base = first_seq; // Oldest segment not acknowledged yet
+    uint32_t next_seq = first_seq; // Next segment to send
+    uint32_t filled = first_seq; // Newest segment read from the callback
+    uint32_t recovery = first_seq; // While recovering, the loss is repaired once everything before this is acknowledged
+    bool recovering = false;
+    int dup_acks = 0; // ACKs in a row that repeated base, the receiver is holding segments past a gap
+    Segment *parity[FEC_MAX_PARITY] = {NULL}; // XOR of each group of the FEC block being sent
+    uint32_t last_seq = 0; // Segment carrying the end of the message, once known
+    bool last_known = false;
+    bool probe = false; // Send one segment even though the peer's window is closed
+    unsigned long long inflight_bytes = 0;
+    long long total_bytes_sent = 0;
+    long long result = -1;
+    int timeouts = 0;
+
+    //trying to set to blocking mode
+    int flags = fcntl(sockfd->socket_fd, F_GETFL, 0);
+    if (flags & O_NONBLOCK) {
+        // If somehow the socket is still non-blocking, force it to blocking
+        flags &= ~O_NONBLOCK;
+        fcntl(sockfd->socket_fd, F_SETFL, flags);
+    }
 
-        // Calculate data size for this packet
-        int data_size = data_in_packet_size;
+    util_digest_init(&sockfd->send_digest, 0);
+    SLOT(first_seq) = pool_get(&sockfd->pool);
+    if (SLOT(first_seq) == NULL) {
+        fprintf(stderr, "No free segment buffer\n");
+        return -1;
+    }
+    int data_size = fill_segment(sockfd, fill, ctx, SLOT(first_seq));
+    if (data_size < 0) {
+        goto done;
+    }
+    if (data_size == 0) {
+        //an empty message is a single empty segment
+        last_known = true;
+        last_seq = first_seq;
+    }
 
-        // Copy data from buffer to packet
-        memcpy(packet.data, current_position, data_size);
+    while (!last_known || base != last_seq + 1) {
+        unsigned long long rate = current_pacing_rate(sockfd);
+        update_kernel_pacing(sockfd, rate);
+
+        // Send as many segments as our window, the peer's advertised window and the pacing rate allow
+        bool paced = false;
+        while ((!last_known || next_seq != last_seq + 1) && next_seq - base < SEND_WINDOW_SEGMENTS) {
+            Segment *slot = SLOT(next_seq);
+            unsigned int length = slot->packet.header.length; // Bytes on the wire
+            unsigned int raw_length = slot->packet.header.raw_length; // Bytes the peer's window has to take
+            if (inflight_bytes + raw_length > sockfd->peer_window && !probe) {
+                break;
+            }
+            if (rate > 0 && now_us() < sockfd->pace_next_us) {
+                paced = true;
+                break;
+            }
+            probe = false;
+
+            //read the next segment ahead, an empty one means this is the last
+            if (!last_known && filled == next_seq) {
+                Segment *ahead = pool_get(&sockfd->pool);
+                if (ahead == NULL) {
+                    fprintf(stderr, "No free segment buffer\n");
+                    goto done;
+                }
+                data_size = fill_segment(sockfd, fill, ctx, ahead);
+                if (data_size <= 0) {
+                    pool_put(&sockfd->pool, ahead);
+                }
+                if (data_size < 0) {
+                    goto done;
+                }
+                if (data_size == 0) {
+                    last_known = true;
+                    last_seq = next_seq;
+                } else {
+                    SLOT(next_seq + 1) = ahead;
+                    filled = next_seq + 1;
+                }
+            }
 
-        // Set header fields
-        packet.header.length = data_size;
-        packet.header.checksum = calculate_checksum(packet.data, data_size);
-        packet.header.flags = 0; // Set appropriate flags if needed
+            // Set sequence number and header fields
+            slot->packet.seq_num = next_seq;
+            if (last_known && next_seq == last_seq) {
+                slot->packet.header.flags |= EOM_FLAG;
+                if (slot->packet.header.flags & DIGEST_FLAG) {
+                    slot->packet.header.echo_time_us = util_digest_final(&sockfd->send_digest);
+                }
+            }
+            slot->packet.header.conn_id = sockfd->conn_id;
+            slot->packet.header.msg_id = sockfd->send_msg_id;
+            slot->retransmitted = false;
 
-        //trying to set to blocking mode
-        int flags = fcntl(sockfd->socket_fd, F_GETFL, 0);
-        if (flags & O_NONBLOCK) {
-            // If somehow the socket is still non-blocking, force it to blocking
-            flags &= ~O_NONBLOCK;
-            fcntl(sockfd->socket_fd, F_SETFL, flags);
+            // Send the packet
+            if (send_segment(sockfd, slot) < 0) {
+                goto done;
+            }
+            pace_segment(sockfd, rate, length);
+            inflight_bytes += raw_length;
+            trace_event(sockfd, RUDP_TRACE_SEND, RUDP_TRACE_REASON_NONE, next_seq, length, inflight_bytes, rate);
+            total_bytes_sent += raw_length;
+
+            //new segments go into the parity of their group, which follows once the block is complete
+            if (sockfd->fec_data > 0) {
+                uint32_t index = (next_seq - first_seq) % sockfd->fec_data;
+                if (fec_add_to_group(sockfd, &parity[index % sockfd->fec_parity], &slot->packet, length) < 0) {
+                    fprintf(stderr, "No free segment buffer\n");
+                    goto done;
+                }
+                if (index == sockfd->fec_data - 1u || (slot->packet.header.flags & EOM_FLAG)) {
+                    if (fec_send_parity(sockfd, parity, next_seq - index, index + 1, rate) < 0) {
+                        goto done;
+                    }
+                }
+            }
+            next_seq++;
         }
 
-        // Send the packet
-        int bytes_sent = sendto(sockfd->socket_fd, &packet, sizeof(RUDP_Packet), 0, (struct sockaddr *)&(sockfd->dest_addr), sizeof(sockfd->dest_addr));
-        if (bytes_sent == -1) {
-            perror("sendto() failed");
-            return -1;  // Handle the error appropriately
+        // Wait for an ACK until the oldest segment in flight times out, the pacer lets the next one go or a connection timer fires
+        long long rto_deadline = (base != next_seq ? SLOT(base)->sent_at : now_us()) + sockfd->rto_us;
+        long long wake_at = paced && sockfd->pace_next_us < rto_deadline ? sockfd->pace_next_us : rto_deadline;
+        int ready = wait_readable(sockfd->socket_fd, timer_deadline(sockfd, wake_at) - now_us());
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll() failed");
+            goto done;
         }
-        remaining_bytes = remaining_bytes-data_size;
-
-        // Move to the next portion of data in the buffer
-        current_position += data_size;
 
-
-        // Receive ACK for this packet
-        RUDPHeader ack_packet;
-        int ack_bytes_received = recv(sockfd->socket_fd, &ack_packet, sizeof(RUDPHeader), 0);
-        if (ack_bytes_received == -1) {
-            printf("failed to receive an ack.\n");
-            perror("recv() failed");
-            return -1;  // Handle the error appropriately
+        if (ready == 0) {
+            if (run_timers(sockfd) < 0) {
+                goto done;
+            }
+            if (now_us() < rto_deadline) {
+                continue;
+            }
+            if (++timeouts > MAX_RETRIES) {
+                fprintf(stderr, "Peer stopped acknowledging, giving up.\n");
+                goto done;
+            }
+            //back off and repeat only the oldest unacknowledged segment, the receiver holds on to what came after it
+            sockfd->rto_us = sockfd->rto_us * 2 > MAX_RTO_US ? MAX_RTO_US : sockfd->rto_us * 2;
+            trace_event(sockfd, RUDP_TRACE_TIMEOUT, RUDP_TRACE_REASON_NONE, base, 0, inflight_bytes, sockfd->rto_us);
+            //a resumed connection repeats its SYN until the server answers
+            if (sockfd->handshake_pending) {
+                RUDP_Handshake syn_packet = sockfd->last_handshake;
+                send_handshake(sockfd, &syn_packet);
+            }
+            if (base == next_seq) {
+                probe = true;
+            } else {
+                if (retransmit_segment(sockfd, SLOT(base), rate, RUDP_TRACE_REASON_TIMEOUT) < 0) {
+                    goto done;
+                }
+                recovering = true;
+                recovery = next_seq;
+            }
+            dup_acks = 0;
+            continue;
         }
 
-        // Check if the received packet is an ACK
-        if (ack_packet.flags != ACK_FLAG) {
-            fprintf(stderr, "Received packet is not an ACK\n");
-            return -1;  // Handle the error appropriately
+        // Receive all the ACKs that arrived
+        RUDP_Handshake control;
+        RUDPHeader ack_packet;
+        ssize_t bytes_received;
+        while ((bytes_received = recv_control(sockfd, MSG_DONTWAIT, &control, NULL, NULL)) >= 0) {
+            if (control.header.type == RUDP_TYPE_NONE) {
+                sockfd->stats.unexpected_packets++;
+                continue;
+            }
+            if (control.header.conn_id == sockfd->conn_id) {
+                sockfd->last_recv_us = now_us();
+            }
+            if (is_probe(sockfd, &control.header)) {
+                send_ack(sockfd, &sockfd->dest_addr, sockfd->recv_window, KEEPALIVE_FLAG);
+                continue;
+            }
+            if (control.header.type == RUDP_TYPE_HANDSHAKE) {
+                handle_late_handshake(sockfd, &control);
+                continue;
+            }
+            ack_packet = control.header;
+            if (control.header.type == RUDP_TYPE_CONTROL && is_peer_fin(sockfd, &ack_packet)) {
+                accept_peer_fin(sockfd);
+                fprintf(stderr, "Peer closed the connection.\n");
+                goto done;
+            }
+            // Check if the received packet is an ACK
+            if (control.header.type != RUDP_TYPE_CONTROL || !(ack_packet.flags & ACK_FLAG) || (ack_packet.flags & FIN_FLAG) || ack_packet.conn_id != sockfd->conn_id) {
+                sockfd->stats.unexpected_packets++;
+                continue;
+            }
+            //any ACK shows the server got our SYN
+            sockfd->handshake_pending = false;
+            uint32_t acked = ack_packet.ack_num - base;
+            if (acked > next_seq - base) {
+                continue; // Acknowledges something we never sent
+            }
+            sockfd->peer_window = ack_packet.window;
+            if (acked == 0 && (ack_packet.flags & KEEPALIVE_FLAG)) {
+                //the answer to a keepalive probe only repeats where the receiver is, it says nothing about a gap
+                continue;
+            }
+            if (acked == 0) {
+                //the receiver got something past a gap, a few of these in a row mean the segment at base was lost
+                trace_event(sockfd, RUDP_TRACE_DUP_ACK, RUDP_TRACE_REASON_NONE, base, 0, sockfd->peer_window, dup_acks + 1);
+                if (base != next_seq && ++dup_acks == DUP_ACK_THRESHOLD && !recovering) {
+                    if (retransmit_segment(sockfd, SLOT(base), rate, RUDP_TRACE_REASON_DUP_ACKS) < 0) {
+                        goto done;
+                    }
+                    recovering = true;
+                    recovery = next_seq;
+                }
+                continue;
+            }
+            dup_acks = 0;
+
+            //an RTT sample from the send time the receiver echoed, it names the transmission that was acknowledged.
+            //without one, from the newest acknowledged segment unless a retransmission was acknowledged with it:
+            //then the ACK may have waited for the repaired gap (Karn's algorithm)
+            long long sample_us = now_us() - SLOT(ack_packet.ack_num - 1)->sent_at;
+            bool clean_sample = true;
+            if (ack_packet.echo_time_us != 0) {
+                sample_us = wall_us() - (long long)ack_packet.echo_time_us;
+                clean_sample = sample_us > 0 && sample_us < MAX_RTO_US;
+            }
+            for (; base != ack_packet.ack_num; base++) {
+                clean_sample = clean_sample && (ack_packet.echo_time_us != 0 || !SLOT(base)->retransmitted);
+                inflight_bytes -= SLOT(base)->packet.header.raw_length;
+                pool_put(&sockfd->pool, SLOT(base));
+            }
+            if (clean_sample) {
+                update_rtt(sockfd, sample_us);
+            }
+            timeouts = 0;
+            trace_event(sockfd, RUDP_TRACE_ACK, RUDP_TRACE_REASON_NONE, base, 0, sockfd->peer_window, sockfd->srtt_us);
+
+            //an ACK short of the recovery point shows the next gap, repair it right away
+            if (recovering) {
+                if ((int32_t)(base - recovery) < 0) {
+                    if (retransmit_segment(sockfd, SLOT(base), rate, RUDP_TRACE_REASON_PARTIAL_ACK) < 0) {
+                        goto done;
+                    }
+                } else {
+                    recovering = false;
+                }
+            }
         }
-
-        // ACK received successfully
-        printf("ACK received for packet %u\n", packet.seq_num);
-    
-
     }
 
-    //sending the last packet
-    int data_size = 4352;
-    RUDP_LAST_PACKET last_packet;
-    last_packet.seq_num = (uint32_t)numOfPackets;
-    memcpy(last_packet.data, current_position, data_size);
+    sockfd->send_seq = next_seq;
+    sockfd->send_msg_id++;
+    result = total_bytes_sent;
 
-    // Set header fields
-    last_packet.header.length = data_size;
-    last_packet.header.checksum = calculate_checksum(last_packet.data, data_size);
-    last_packet.header.flags = 0; // Set appropriate flags if needed
-
-    // Send the packet
-    int bytes_sent = sendto(sockfd->socket_fd, &last_packet, sizeof(RUDP_LAST_PACKET), 0, (struct sockaddr *)&(sockfd->dest_addr), sizeof(sockfd->dest_addr));
-    if (bytes_sent == -1) {
-        perror("sendto() failed");
-        return -1;  // Handle the error appropriately
+done:
+    //give back whatever is still held after a failure
+    for (; base != filled + 1; base++) {
+        pool_put(&sockfd->pool, SLOT(base));
     }
-
-    
-    // Receive ACK for this packet
-    RUDPHeader ack_packet;
-    int ack_bytes_received = recv(sockfd->socket_fd, &ack_packet, sizeof(RUDPHeader), 0);
-    if (ack_bytes_received == -1) {
-        perror("recv() failed");
-        return -1;  // Handle the error appropriately
+    for (int group = 0; group < FEC_MAX_PARITY; group++) {
+        if (parity[group] != NULL) {
+            pool_put(&sockfd->pool, parity[group]);
+        }
     }
+#undef SLOT
+    return result;
+}
 
-    // Check if the received packet is an ACK
-    if (ack_packet.flags != ACK_FLAG) {
-        fprintf(stderr, "Received packet is not an ACK\n");
-        return -1;  // Handle the error appropriately
+//position of rudp_send/rudp_recv inside the caller's buffer
+typedef struct {
+    char *buffer;
+    unsigned int size;
+    unsigned int offset;
+} BufferCursor;
+
+static int fill_from_buffer(void *ctx, void *data, unsigned int capacity) {
+    BufferCursor *cursor = ctx;
+    unsigned int length = cursor->size - cursor->offset;
+    if (length > capacity) {
+        length = capacity;
     }
+    memcpy(data, cursor->buffer + cursor->offset, length);
+    cursor->offset += length;
+    return (int)length;
+}
 
-    // ACK received successfully
-    printf("ACK received for packet %u\n", last_packet.seq_num);
-
-
-
-    return 0; // Success
+static int deliver_to_buffer(void *ctx, const void *data, unsigned int length) {
+    BufferCursor *cursor = ctx;
+    if (length > cursor->size - cursor->offset) {
+        printf("Buffer overflow prevented. Total bytes so far: %u, Current packet size: %u, Buffer size: %u\n", cursor->offset, length, cursor->size);
+        return -1;
+    }
+    memcpy(cursor->buffer + cursor->offset, data, length);
+    cursor->offset += length;
+    return 0;
 }
 
-//sending an end signal from the sender to the receiver so it won't transffer the file again.
-int rudp_send_end_signal(RUDP_Socket *sockfd) {
-    if (!sockfd->isConnected) {
-        fprintf(stderr, "Socket not connected.\n");
+// Receives one message of up to buffer_size bytes from the other side
+int rudp_recv(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size) {
+    if (buffer == NULL) {
+        fprintf(stderr, "Buffer pointer is null\n");
         return -1;
     }
 
+    BufferCursor cursor = {(char *)buffer, buffer_size, 0};
+    long long received = recv_message(sockfd, deliver_to_buffer, &cursor, buffer_size);
+    if (received < 0) {
+        return received == RUDP_PEER_CLOSED ? RUDP_PEER_CLOSED : -1;
+    }
+    return (int)cursor.offset;
+}
 
-    RUDPHeader end_packet = {0, 0, END_FLAG};  // No data, just an end flag
-    if (sendto(sockfd->socket_fd, &end_packet, sizeof(end_packet), 0, 
-               (struct sockaddr *)&(sockfd->dest_addr), sizeof(sockfd->dest_addr)) < 0) {
-        perror("sendto failed for end signal");
+// Sends data to the other side
+int rudp_send(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size) {
+    BufferCursor cursor = {(char *)buffer, buffer_size, 0};
+    if (rudp_send_stream(sockfd, fill_from_buffer, &cursor) < 0) {
         return -1;
     }
+    return 0; // Success
+}
+
+// Closes the RUDP socket
+int rudp_close(RUDP_Socket *sockfd) {
+    if (sockfd != NULL) {
+        close(sockfd->socket_fd);
+        rudp_trace_close(sockfd->trace);
+        pool_destroy(&sockfd->pool);
+        free(sockfd);
+    }
     return 0;
 }
 
 
-//the receiver receive an end signal from the sender
-int rudp_recv_end_signal(RUDP_Socket *sockfd) {
+//after the peer closed, keeps answering its FIN in case our FIN-ACK was lost
+static void linger_after_peer_fin(RUDP_Socket *sockfd) {
+    long long linger_us = sockfd->linger_us > 0 ? sockfd->linger_us : 2 * sockfd->rto_us;
+    long long deadline = now_us() + linger_us;
+    long long remaining_us;
+    while ((remaining_us = deadline - now_us()) > 0) {
+        if (wait_readable(sockfd->socket_fd, remaining_us) <= 0) {
+            continue;
+        }
+        RUDP_Handshake control;
+        if (recv_control(sockfd, MSG_DONTWAIT, &control, NULL, NULL) >= 0 && control.header.type == RUDP_TYPE_CONTROL && is_peer_fin(sockfd, &control.header)) {
+            send_fin(sockfd, FIN_FLAG | ACK_FLAG);
+        }
+    }
+}
+
+// Disconnects from an actively connected socket
+int rudp_disconnect(RUDP_Socket *sockfd) {
     if (!sockfd->isConnected) {
-        fprintf(stderr, "Socket is not connected.\n");
-        return -1;
+        //the peer closed first, we only linger
+        if (sockfd->peer_closed) {
+            linger_after_peer_fin(sockfd);
+            sockfd->peer_closed = false;
+            sockfd->conn_id = 0;
+            return 1;
+        }
+        fprintf(stderr, "Invalid operation: Socket is not connected.\n");
+        return 0;
     }
 
-    RUDPHeader header;
-    memset(&header, 0, sizeof(header));  // Clear the header structure before reading
-    socklen_t addr_len = sizeof(sockfd->dest_addr);
-    ssize_t bytes_received = 0;
-    
-    // set a timeout if you don't want to block indefinitely
-    struct timeval tv = {30, 0};  // 30 seconds timeout
-    if (setsockopt(sockfd->socket_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv) != 0) {
-            perror("setsockopt failed to set timeout");
-            return -1;
+    //send our FIN until the peer acknowledges it, backing off like any retransmission
+    bool acknowledged = false;
+    long long timeout_us = sockfd->rto_us;
+    for (int attempt = 0; attempt <= FIN_RETRIES && !acknowledged; attempt++) {
+        long long sent_at = now_us();
+        send_fin(sockfd, FIN_FLAG);
+
+        long long remaining_us;
+        while (!acknowledged && (remaining_us = sent_at + timeout_us - now_us()) > 0) {
+            if (wait_readable(sockfd->socket_fd, remaining_us) <= 0) {
+                continue;
+            }
+            RUDP_Handshake control;
+            if (recv_control(sockfd, MSG_DONTWAIT, &control, NULL, NULL) < 0 || control.header.type != RUDP_TYPE_CONTROL ||
+                control.header.conn_id != sockfd->conn_id) {
+                continue;
+            }
+            RUDPHeader header = control.header;
+            if ((header.flags & FIN_FLAG) && (header.flags & ACK_FLAG)) {
+                acknowledged = true;
+            } else if (header.flags & FIN_FLAG) {
+                //both sides are closing at once
+                send_fin(sockfd, FIN_FLAG | ACK_FLAG);
+            }
+        }
+        timeout_us = timeout_us * 2 > MAX_RTO_US ? MAX_RTO_US : timeout_us * 2;
     }
 
+    //the socket stays open and can connect or accept again
+    sockfd->isConnected = false;
+    sockfd->conn_id = 0;
+    if (!acknowledged) {
+        fprintf(stderr, "Peer did not acknowledge the disconnect.\n");
+        return 0;
+    }
+    return 1;
+}
 
-    // Receive a packet
-    bytes_received = recvfrom(sockfd->socket_fd, &header, sizeof(RUDPHeader), 0,
-                              (struct sockaddr *)&(sockfd->dest_addr), &addr_len);
+// Sets how long rudp_disconnect keeps answering a closing peer, 0 for twice the retransmission timeout
+int rudp_set_linger(RUDP_Socket *sockfd, unsigned int linger_ms) {
+    sockfd->linger_us = (long long)linger_ms * 1000;
+    return 0;
+}
 
-    
+// Sets a fixed pacing rate in bytes per second, 0 to pace at a full window per round trip
+int rudp_set_pacing_rate(RUDP_Socket *sockfd, unsigned long long bytes_per_second) {
+    sockfd->pacing_rate = bytes_per_second;
+    return 0;
+}
 
-    
-    if (bytes_received <= 0) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            printf("No end signal received within timeout period.\n");
-            return 0;  // No data received (timeout or non-blocking mode)
-        }
-        perror("recvfrom failed");
-        return -1;
-    }
+// Sets the keepalive probe interval and the idle timeout, 0 turns either off
+int rudp_set_keepalive(RUDP_Socket *sockfd, unsigned int interval_ms, unsigned int idle_timeout_ms) {
+    sockfd->keepalive_us = (long long)interval_ms * 1000;
+    sockfd->idle_timeout_us = (long long)idle_timeout_ms * 1000;
+    return 0;
+}
 
-    if (bytes_received != sizeof(header)) {
-        fprintf(stderr, "Incomplete packet received.\n");
+// Turns SO_TIMESTAMPING receive stamps on or off, the card only stamps when it was configured for it (SIOCSHWTSTAMP)
+int rudp_set_timestamping(RUDP_Socket *sockfd, bool enable) {
+    int flags = enable ? SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE : 0;
+    if (setsockopt(sockfd->socket_fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+        perror("setsockopt(SO_TIMESTAMPING) failed");
         return -1;
     }
+    sockfd->timestamping = enable;
+    return 0;
+}
 
-    if (header.flags & END_FLAG) {
-        printf("End of transmission signal received.\n");
-        return 1;  // End signal received
-    }
-
-    return 0;  // No end signal flag found, normal packet received
+// Applies the tuning's socket options, the advertised receive window follows the receive buffer
+int rudp_set_tuning(RUDP_Socket *sockfd, const Util_Tuning *tuning) {
+    int result = util_tuning_apply(sockfd->socket_fd, tuning);
+    update_recv_window(sockfd);
+    return result;
 }
 
+// Reads back the socket options the kernel uses
+int rudp_get_tuning(RUDP_Socket *sockfd, Util_Tuning *effective) {
+    return util_tuning_effective(sockfd->socket_fd, effective);
+}
 
-// Closes the RUDP socket
-int rudp_close(RUDP_Socket *sockfd) {
-    if (sockfd != NULL) {
-        close(sockfd->socket_fd);
-        free(sockfd);
+// Starts writing an event trace to path, replacing any trace being written, or stops tracing for a NULL path
+int rudp_set_trace(RUDP_Socket *sockfd, const char *path) {
+    rudp_trace_close(sockfd->trace);
+    sockfd->trace = NULL;
+    if (path == NULL) {
+        return 0;
     }
-    return 0;
+    sockfd->trace = rudp_trace_open(path);
+    return sockfd->trace != NULL ? 0 : -1;
 }
 
+// Copies the delay measurements and the RTT estimate of the current connection
+int rudp_get_stats(RUDP_Socket *sockfd, RUDP_Stats *stats) {
+    *stats = sockfd->stats;
+    stats->srtt_us = sockfd->srtt_us;
+    stats->rttvar_us = sockfd->rttvar_us;
+    stats->rto_us = sockfd->rto_us;
+    return 0;
+}
 
-// Disconnects from an actively connected socket
-int rudp_disconnect(RUDP_Socket *sockfd) {
+// Answers queued control packets and fires the connection timers without blocking
+int rudp_keepalive(RUDP_Socket *sockfd) {
     if (!sockfd->isConnected) {
-        fprintf(stderr, "Invalid operation: Socket is not connected.\n");
         return 0;
     }
 
-    // Simply close the underlying UDP socket
-    close(sockfd->socket_fd);
-    sockfd->isConnected = false;
-    return 1;
+    //only control packets are taken off the socket, data stays queued for the next rudp_recv
+    RUDP_Handshake control;
+    struct sockaddr_storage sender_addr;
+    socklen_t sender_len;
+    ssize_t bytes_received;
+    while ((bytes_received = recv_control(sockfd, MSG_DONTWAIT | MSG_PEEK, &control, NULL, NULL)) >= 0) {
+        if (control.header.type == RUDP_TYPE_DATA) {
+            break;
+        }
+        sender_len = sizeof(sender_addr);
+        recv_control(sockfd, MSG_DONTWAIT, &control, &sender_addr, &sender_len);
+        if (control.header.type == RUDP_TYPE_NONE || control.header.conn_id != sockfd->conn_id) {
+            continue;
+        }
+        sockfd->last_recv_us = now_us();
+        if (control.header.type == RUDP_TYPE_HANDSHAKE) {
+            handle_late_handshake(sockfd, &control);
+        } else if (is_peer_fin(sockfd, &control.header)) {
+            accept_peer_fin(sockfd);
+            return 0;
+        } else if (is_probe(sockfd, &control.header)) {
+            send_ack(sockfd, &sender_addr, sockfd->recv_window, KEEPALIVE_FLAG);
+        }
+    }
 
+    if (run_timers(sockfd) < 0) {
+        return 0;
+    }
+    return 1;
 }
 
 /*
@@ -550,20 +2239,9 @@ int rudp_disconnect(RUDP_Socket *sockfd) {
 * However, it is good enough for this assignment.
 * @note You are free to use any other checksum function as well.
 * You can also use this function as such without any change.
+* @note The result is the same on every host, sent big-endian it gives the RFC1071 checksum bytes.
 */
+
 unsigned short int calculate_checksum(void *data, unsigned int bytes) {
-    unsigned short int *data_pointer = (unsigned short int *)data;
-    unsigned int total_sum = 0;
-    // Main summing loop
-    while (bytes > 1) {
-        total_sum += *data_pointer++;
-        bytes -= 2;
-    }
-    // Add left-over byte, if any
-    if (bytes > 0)
-        total_sum += *((unsigned char *)data_pointer);
-    // Fold 32-bit sum to 16 bits
-    while (total_sum >> 16)
-        total_sum = (total_sum & 0xFFFF) + (total_sum >> 16);
-    return (~((unsigned short int)total_sum));
+    return checksum_finish(checksum_add(0, data, bytes));
 }
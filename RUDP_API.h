@@ -14,6 +14,7 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <sys/time.h>
+#include "Util_Tune.h"
 // #include "RUDP_API.h"
 
 #define BUFFER_SIZE 65507
@@ -25,57 +26,222 @@
 // } BufferedPacket;
 
 
+// Every datagram starts with a header of RUDP_WIRE_HEADER_SIZE bytes, followed by its payload.
+// Fields are big-endian at fixed offsets, with no padding:
+//   0 magic (2)     RUDP_WIRE_MAGIC
+//   2 version (1)   RUDP_WIRE_VERSION, datagrams of other versions are ignored
+//   3 type (1)      RUDP_TYPE_*
+//   4 flags (2)     *_FLAG
+//   6 length (2)    data bytes of a segment
+//   8 checksum (2)  of a data segment or parity as negotiated: RFC1071 over its header with this field zeroed, then its payload.
+//                   0 in control packets, handshakes and without a checksum
+//  10 raw_length (2)
+//  12 conn_id (4)
+//  16 msg_id (4)
+//  20 seq (4)       segment sequence number, the initial sequence number in a SYN or SYN-ACK
+//  24 ack (4)
+//  28 window (4)
+//  32 send_time_us (8)
+//  40 echo_time_us (8)  in the last segment of a verified message, the message's digest
+// A control packet has no payload, a handshake carries RUDP_HANDSHAKE_BODY_SIZE bytes:
+//   mss (2), checksum_type (1), fec_data (1), fec_parity (1), compression (1), resume_token (8)
+// A data segment carries length bytes, an FEC parity the negotiated mss.
+#define RUDP_WIRE_MAGIC 0x5255 // "RU"
+#define RUDP_WIRE_VERSION 2
+#define RUDP_WIRE_HEADER_SIZE 48
+#define RUDP_HANDSHAKE_BODY_SIZE 14
+
+// What a datagram carries
+#define RUDP_TYPE_NONE      0 // Not a valid RUDP datagram of our version, only seen after decoding
+#define RUDP_TYPE_CONTROL   1 // ACK, FIN or keepalive probe
+#define RUDP_TYPE_HANDSHAKE 2 // SYN or SYN-ACK
+#define RUDP_TYPE_DATA      3 // Data segment or FEC parity
+
+// A header as the host works with it, see above for how it is sent
 typedef struct {
+    uint8_t type;       // RUDP_TYPE_*
     uint16_t length;    // 2 bytes for length
     uint16_t checksum;  // 2 bytes for checksum
-    uint8_t flags;      // 1 byte for flags
+    uint16_t flags;     // 2 bytes for flags
+    uint16_t raw_length; // Data bytes before compression, equal to length for a stored segment
+    uint32_t ack_num;   // Next sequence number the receiver expects (cumulative ACK)
+    uint32_t window;    // Free receive buffer space of the sender of this header, in bytes
+    uint32_t conn_id;   // Random connection ID chosen by the client during the handshake
+    uint32_t msg_id;    // Message the segment belongs to, messages on a connection are numbered from 1
+    uint64_t send_time_us; // Sender's wall clock when a data segment left, in microseconds
+    uint64_t echo_time_us; // In an ACK, send_time_us of the segment that last advanced ack_num
 }RUDPHeader;
 
+// SYN and SYN-ACK packets, carrying the parameters each side offers
 typedef struct {
-    uint32_t seq_num;   // Sequence number
-    char data[65400];  // Data payload
-    RUDPHeader header; //The header
-} RUDP_Packet;
+    RUDPHeader header;
+    uint32_t isn;           // Initial sequence number of the sender of this packet, sent as the header's seq
+    uint16_t mss;           // Largest data payload per segment the sender of this packet accepts
+    uint8_t checksum_type;  // RUDP_CHECKSUM_* asked for, or chosen in a SYN-ACK
+    uint8_t fec_data;       // Data segments per forward error correction block, 0 without FEC
+    uint8_t fec_parity;     // XOR parity segments sent after each block
+    uint8_t compression;    // RUDP_COMPRESSION_* asked for, or chosen in a SYN-ACK
+    uint64_t resume_token;  // Token from an earlier connection in a SYN, a new token in a SYN-ACK
+} RUDP_Handshake;
+
+// Checksum types that can be negotiated, the stronger of the two preferences wins
+#define RUDP_CHECKSUM_NONE    0
+#define RUDP_CHECKSUM_RFC1071 1
+
+// Payload compression that can be negotiated, used when either side asks for it
+#define RUDP_COMPRESSION_NONE 0
+#define RUDP_COMPRESSION_LZ   1 // LZ4-style segment compression, segments that do not shrink are sent as they are
+
+// What a client remembers about a server to reconnect without waiting for the handshake
+typedef struct {
+    uint64_t token;
+    uint16_t mss;
+    uint8_t checksum_type;
+    uint8_t fec_data;
+    uint8_t fec_parity;
+    uint8_t compression;
+    uint32_t peer_window;
+} RUDP_Resume;
+
+#define RUDP_MAX_DATA 65400 // Data bytes carried by a full packet
+#define RUDP_PEER_CLOSED (-2) // Returned by rudp_recv and rudp_recv_stream once the peer disconnected, unlike 0 for an empty message
 
-typedef struct{
-    uint32_t seq_num;   // Sequence number
-    char data[4352];  // Data payload
+typedef struct {
     RUDPHeader header; //The header
-} RUDP_LAST_PACKET;
+    uint32_t seq_num;   // Sequence number
+    char data[RUDP_MAX_DATA];  // Data payload
+} RUDP_Packet;
 
 // Define flags for the RUDP protocol
 #define SYN_FLAG    0x01
 #define SYN_ACK_FLAG 0x02
 #define ACK_FLAG    0x04
+#define RESUME_FLAG 0x20
+
+// Delay measurements, verification counts and dropped packets of a connection, see rudp_get_stats.
+// One-way delays compare the sender's clock with ours, they are only absolute when both clocks are synchronized, their variation always is.
+typedef struct {
+    unsigned long long samples;          // Data segments timed on arrival
+    unsigned long long kernel_samples;   // Of those, stamped by the kernel (SO_TIMESTAMPING) rather than when rudp read them
+    unsigned long long hardware_samples; // Of those, also stamped by the network card
+    long long owd_us;            // One-way delay of the last segment
+    long long owd_min_us;        // Smallest one-way delay, what the path takes without queueing
+    long long owd_max_us;        // Largest one-way delay
+    long long jitter_us;         // Interarrival jitter, the smoothed one-way delay variation of RFC 3550
+    long long kernel_to_user_us; // Smoothed time from the kernel's stamp until rudp read the segment
+    long long nic_to_kernel_us;  // Smoothed time from the card's stamp to the kernel's, only meaningful when the card's clock follows the system clock
+    long long srtt_us;           // Smoothed round-trip time of the data we sent
+    long long rttvar_us;         // Round-trip time variation
+    long long rto_us;            // Current retransmission timeout
+    unsigned long long verified_messages; // Messages received whose data matched the sender's digest, see rudp_set_verify
+    unsigned long long digest_mismatches; // Messages received whose data did not match it
+    unsigned long long corrupt_segments;   // Data segments dropped for a bad checksum, length or compressed body, retransmission repairs them
+    unsigned long long unexpected_packets; // Datagrams dropped for not being RUDP of our version, of this connection or of the message
+    unsigned long long send_errors;        // Segments the kernel had no room for (ENOBUFS, EAGAIN), resent like a lost segment
+} RUDP_Stats;
 
 // Structure representing the RUDP socket
 typedef struct _rudp_socket RUDP_Socket;
 
-// Allocates a new structure for the RUDP socket
+// Allocates a new structure for the RUDP socket, dual-stack IPv6 unless the host has no IPv6, a server listens on both families.
+// Returns NULL when the socket cannot be set up.
 RUDP_Socket* rudp_socket(bool isServer, unsigned short int listen_port);
 
-// Tries to connect to the other side via RUDP
+// Tries to connect to the other side via RUDP, dest_ip is an IPv4 or IPv6 address or a host name.
+// Returns 1 once connected or 0 on failure.
 int rudp_connect(RUDP_Socket *sockfd, const char *dest_ip, unsigned short int dest_port);
 
-// Accepts incoming connection request and completes the handshake
+// Reconnects to a server known from an earlier connection, data can be sent right away without waiting a round trip
+int rudp_connect_resume(RUDP_Socket *sockfd, const char *dest_ip, unsigned short int dest_port, const RUDP_Resume *ticket);
+
+// Copies what is needed to later resume to the connected server, returns 0 on success or -1 when there is no ticket
+int rudp_get_resume(RUDP_Socket *sockfd, RUDP_Resume *ticket);
+
+// Accepts incoming connection request and completes the handshake, returns 1 once connected or 0 on failure
 int rudp_accept(RUDP_Socket *sockfd);
 
-// Receives data from the other side
+// Sets the largest data payload per segment offered in the handshake, the smaller offer of the two sides is used
+int rudp_set_mss(RUDP_Socket *sockfd, unsigned short int mss);
+
+// Sets the checksum type (RUDP_CHECKSUM_*) asked for in the handshake
+int rudp_set_checksum(RUDP_Socket *sockfd, int checksum_type);
+
+// Sets the payload compression asked for in the handshake
+int rudp_set_compression(RUDP_Socket *sockfd, int compression);
+
+// Asks for forward error correction in the handshake: parity_segments XOR parities after every data_segments segments, 0 and 0 for none.
+// Parity j covers the block's segments i with i % parity_segments == j, so a lost segment per group is rebuilt without a retransmission.
+// The side asking for more redundancy wins.
+int rudp_set_fec(RUDP_Socket *sockfd, unsigned int data_segments, unsigned int parity_segments);
+
+// Sends an XXH64 digest of every message with its last segment, the receiver hashes the data as it delivers it and compares.
+// rudp_recv counts the outcome in the stats and returns -1 for a message that does not match, the connection stays usable.
+int rudp_set_verify(RUDP_Socket *sockfd, bool enable);
+
+// Receives one message of up to buffer_size bytes from the other side, returns the number of data bytes received,
+// RUDP_PEER_CLOSED once the peer disconnected or -1 on failure
 int rudp_recv(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size);
 
 // Sends data to the other side
 int rudp_send(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size);
 
-int rudp_send_end_signal(RUDP_Socket *sockfd);
+// Called with each in-order piece of a message received by rudp_recv_stream, returns 0 to go on or -1 to abort
+typedef int (*rudp_deliver_cb)(void *ctx, const void *data, unsigned int length);
+
+// Called by rudp_send_stream to fill up to capacity bytes of the next segment, returns the bytes written, 0 at the end of the message or -1 to abort
+typedef int (*rudp_fill_cb)(void *ctx, void *data, unsigned int capacity);
+
+// Receives one message of any size without buffering it, returns the number of data bytes delivered,
+// RUDP_PEER_CLOSED once the peer disconnected or -1 on failure
+long long rudp_recv_stream(RUDP_Socket *sockfd, rudp_deliver_cb deliver, void *ctx);
 
-int rudp_recv_end_signal(RUDP_Socket *sockfd);
+// Sends one message of any size pulled from the callback, returns the number of data bytes sent
+long long rudp_send_stream(RUDP_Socket *sockfd, rudp_fill_cb fill, void *ctx);
 
-// Disconnects from an actively connected socket
+// Disconnects from an actively connected socket with an acknowledged FIN, the socket can then connect or accept again.
+// After rudp_recv reported the peer's disconnect, it lingers to answer repeats of the peer's FIN.
 int rudp_disconnect(RUDP_Socket *sockfd);
 
+// Sets how long rudp_disconnect lingers after the peer disconnected, 0 for twice the retransmission timeout
+int rudp_set_linger(RUDP_Socket *sockfd, unsigned int linger_ms);
+
+// Paces segments at a fixed rate in bytes per second, 0 (the default) paces a full window per round trip
+int rudp_set_pacing_rate(RUDP_Socket *sockfd, unsigned long long bytes_per_second);
+
+// Probes a silent peer every interval_ms and drops the connection after idle_timeout_ms without hearing from it, 0 turns either off
+int rudp_set_keepalive(RUDP_Socket *sockfd, unsigned int interval_ms, unsigned int idle_timeout_ms);
+
+// Answers keepalive probes and runs the connection timers without blocking, for applications idle outside rudp calls.
+// Returns 1 while the connection is alive, 0 once the peer disconnected or went idle for too long.
+int rudp_keepalive(RUDP_Socket *sockfd);
+
+// Stamps arriving segments in the kernel with SO_TIMESTAMPING, and on the network card where it is set up for it.
+// Without it one-way delays are measured from when rudp reads a segment.
+int rudp_set_timestamping(RUDP_Socket *sockfd, bool enable);
+
+// Applies buffer sizes, busy polling and DSCP marking to the socket, the receive window we advertise follows the receive buffer.
+// Pinning is per thread, see util_tuning_pin. Returns -1 when the kernel refused a setting, the others still apply.
+int rudp_set_tuning(RUDP_Socket *sockfd, const Util_Tuning *tuning);
+
+// Reads back the buffer sizes, busy polling and DSCP marking the kernel uses for the socket
+int rudp_get_tuning(RUDP_Socket *sockfd, Util_Tuning *effective);
+
+// Writes an event trace of the socket's connections to path, for RUDP_TraceDump to turn into CSV. A NULL path stops tracing.
+int rudp_set_trace(RUDP_Socket *sockfd, const char *path);
+
+// Copies the delay measurements of the current connection, they start over with every connection
+int rudp_get_stats(RUDP_Socket *sockfd, RUDP_Stats *stats);
+
 // Closes the RUDP socket
 int rudp_close(RUDP_Socket *sockfd);
 
+// Writes a header and its sequence number in the wire format, RUDP_WIRE_HEADER_SIZE bytes at wire
+void rudp_encode_header(void *wire, const RUDPHeader *header, uint32_t seq);
+
+// Reads a header in the wire format from size bytes at wire, returns -1 when they are not a RUDP header of our version
+int rudp_decode_header(const void *wire, size_t size, RUDPHeader *header, uint32_t *seq);
+
+// RFC1071 checksum of bytes at data, the same value on every host, to be sent big-endian
 unsigned short int calculate_checksum(void *data, unsigned int bytes);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include "RUDP_API.h"
+#include "RUDP_Compress.h"
+#include "Util_DataGen.h"
+#include "Util_Digest.h"
+
+#define DEFAULT_TIME_MS 200 // How long each benchmark runs
+#define MAX_BATCH (1L << 20) // Most iterations between two looks at the clock
+#define COUNTERS 4
+#define SMALL_SEGMENT 1400 // A segment that fits an Ethernet frame
+#define LARGE_SEGMENT RUDP_MAX_DATA
+#define MESSAGE_SIZE (1024 * 1024) // Message sent per op by the RUDP loopback benchmarks
+#define BENCH_PORT 9988 // RUDP loopback port, the next one is used for the small-segment run
+
+//heap allocations made by this thread, the benchmarks report how many an op makes on the benchmarking thread
+static __thread unsigned long long allocations = 0;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+
+//glibc's allocator behind a counter, free and the aligned allocations are not counted
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    allocations++;
+    return __libc_realloc(pointer, size);
+}
+
+//hardware counters of the benchmarking thread, read as one group so they cover the same instructions
+typedef struct {
+    int fds[COUNTERS];
+    bool available;
+    bool user_only; // The kernel's part is not counted, perf_event_paranoid does not allow it
+} Counters;
+
+static const char *const counter_names[COUNTERS] = {"cycles", "instructions", "cache-misses", "branch-misses"};
+static const uint64_t counter_configs[COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+                                                   PERF_COUNT_HW_BRANCH_MISSES};
+
+static int open_counter(uint64_t config, int group, bool user_only) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+//opens the counters with the kernel's part if allowed, else user space only, else not at all
+static void counters_open(Counters *counters) {
+    counters->available = false;
+    counters->user_only = false;
+    for (int attempt = 0; attempt < 2 && !counters->available; attempt++) {
+        counters->user_only = attempt == 1;
+        int opened = 0;
+        for (; opened < COUNTERS; opened++) {
+            counters->fds[opened] = open_counter(counter_configs[opened], opened == 0 ? -1 : counters->fds[0], counters->user_only);
+            if (counters->fds[opened] < 0) {
+                break;
+            }
+        }
+        counters->available = opened == COUNTERS;
+        if (!counters->available) {
+            while (opened-- > 0) {
+                close(counters->fds[opened]);
+            }
+        }
+    }
+}
+
+static void counters_start(Counters *counters) {
+    if (counters->available) {
+        ioctl(counters->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(counters->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+//reads the counts into values, false when there are none
+static bool counters_stop(Counters *counters, uint64_t *values) {
+    if (!counters->available) {
+        return false;
+    }
+    ioctl(counters->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    uint64_t group[1 + COUNTERS];
+    if (read(counters->fds[0], group, sizeof(group)) != (ssize_t)sizeof(group) || group[0] != COUNTERS) {
+        return false;
+    }
+    memcpy(values, group + 1, sizeof(uint64_t) * COUNTERS);
+    return true;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//runs an op iterations times, ctx holds its inputs
+typedef void (*bench_fn)(void *ctx, long iterations);
+
+typedef struct {
+    const char *name;
+    bench_fn run;
+    void *ctx;
+    size_t bytes; // Data bytes an op processes, 0 when throughput does not apply
+} Bench;
+
+//keeps results alive so the compiler cannot drop the work
+static volatile uint64_t sink;
+
+//fixed inputs shared by the benchmarks
+static char *random_data;
+static char *text_data;
+static char *compressed_small;
+static char *compressed_large;
+static int compressed_small_size;
+static int compressed_large_size;
+static char scratch[2 * RUDP_MAX_DATA];
+
+static void bench_checksum_small(void *ctx, long iterations) {
+    (void)ctx;
+    for (long i = 0; i < iterations; i++) {
+        sink += calculate_checksum(random_data, SMALL_SEGMENT);
+    }
+}
+
+static void bench_checksum_large(void *ctx, long iterations) {
+    (void)ctx;
+    for (long i = 0; i < iterations; i++) {
+        sink += calculate_checksum(random_data, LARGE_SEGMENT);
+    }
+}
+
+//a data segment header as the sender fills it in
+static RUDPHeader sample_header(void) {
+    RUDPHeader header;
+    memset(&header, 0, sizeof(header));
+    header.type = RUDP_TYPE_DATA;
+    header.flags = 0x10;
+    header.length = SMALL_SEGMENT;
+    header.raw_length = SMALL_SEGMENT;
+    header.checksum = 0xbeef;
+    header.conn_id = 0x12345678;
+    header.msg_id = 7;
+    header.window = 4 * 1024 * 1024;
+    header.send_time_us = 1700000000000000ULL;
+    return header;
+}
+
+static void bench_header_encode(void *ctx, long iterations) {
+    (void)ctx;
+    RUDPHeader header = sample_header();
+    unsigned char wire[RUDP_WIRE_HEADER_SIZE];
+    for (long i = 0; i < iterations; i++) {
+        rudp_encode_header(wire, &header, (uint32_t)i);
+        __asm__ volatile("" : : "r"(wire) : "memory");
+    }
+    sink += wire[23];
+}
+
+static void bench_header_decode(void *ctx, long iterations) {
+    (void)ctx;
+    RUDPHeader header = sample_header();
+    unsigned char wire[RUDP_WIRE_HEADER_SIZE];
+    rudp_encode_header(wire, &header, 42);
+    uint32_t seq = 0;
+    for (long i = 0; i < iterations; i++) {
+        __asm__ volatile("" : : "r"(wire) : "memory");
+        sink += (uint64_t)rudp_decode_header(wire, sizeof(wire), &header, &seq) + seq;
+    }
+}
+
+static void bench_compress_small(void *ctx, long iterations) {
+    (void)ctx;
+    for (long i = 0; i < iterations; i++) {
+        sink += rudp_compress(text_data, SMALL_SEGMENT, scratch, sizeof(scratch));
+    }
+}
+
+static void bench_compress_large(void *ctx, long iterations) {
+    (void)ctx;
+    for (long i = 0; i < iterations; i++) {
+        sink += rudp_compress(text_data, LARGE_SEGMENT, scratch, sizeof(scratch));
+    }
+}
+
+static void bench_decompress_small(void *ctx, long iterations) {
+    (void)ctx;
+    for (long i = 0; i < iterations; i++) {
+        sink += rudp_decompress(compressed_small, compressed_small_size, scratch, sizeof(scratch));
+    }
+}
+
+static void bench_decompress_large(void *ctx, long iterations) {
+    (void)ctx;
+    for (long i = 0; i < iterations; i++) {
+        sink += rudp_decompress(compressed_large, compressed_large_size, scratch, sizeof(scratch));
+    }
+}
+
+static void bench_digest(void *ctx, long iterations) {
+    (void)ctx;
+    for (long i = 0; i < iterations; i++) {
+        Util_Digest digest;
+        util_digest_init(&digest, 0);
+        util_digest_update(&digest, random_data, LARGE_SEGMENT);
+        sink += util_digest_final(&digest);
+    }
+}
+
+//two UDP sockets connected to each other on loopback, what every RUDP segment costs in system calls
+typedef struct {
+    int a;
+    int b;
+    size_t size;
+} UdpPair;
+
+static int udp_pair_open(UdpPair *pair, size_t size) {
+    pair->size = size;
+    pair->a = socket(AF_INET, SOCK_DGRAM, 0);
+    pair->b = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct sockaddr_in a_addr = addr, b_addr = addr;
+    socklen_t length = sizeof(addr);
+    if (pair->a < 0 || pair->b < 0 || bind(pair->a, (struct sockaddr *)&a_addr, sizeof(a_addr)) < 0 ||
+        bind(pair->b, (struct sockaddr *)&b_addr, sizeof(b_addr)) < 0 ||
+        getsockname(pair->a, (struct sockaddr *)&a_addr, &length) < 0 || getsockname(pair->b, (struct sockaddr *)&b_addr, &length) < 0 ||
+        connect(pair->a, (struct sockaddr *)&b_addr, sizeof(b_addr)) < 0 || connect(pair->b, (struct sockaddr *)&a_addr, sizeof(a_addr)) < 0) {
+        perror("UDP pair");
+        return -1;
+    }
+    return 0;
+}
+
+static void udp_pair_close(UdpPair *pair) {
+    close(pair->a);
+    close(pair->b);
+}
+
+//one datagram out of one socket and into the other
+static void bench_udp_loopback(void *ctx, long iterations) {
+    UdpPair *pair = ctx;
+    for (long i = 0; i < iterations; i++) {
+        if (send(pair->a, random_data, pair->size, 0) < 0 || recv(pair->b, scratch, sizeof(scratch), 0) < 0) {
+            perror("UDP loopback");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+//a RUDP connection on loopback, the receiving side runs in its own thread
+typedef struct {
+    RUDP_Socket *server;
+    RUDP_Socket *client;
+    pthread_t receiver;
+    unsigned long long offset; // Of the message being sent
+} RudpPair;
+
+static int discard(void *ctx, const void *data, unsigned int length) {
+    (void)ctx;
+    (void)data;
+    (void)length;
+    return 0;
+}
+
+//receives messages until the client disconnects
+static void *rudp_receiver(void *arg) {
+    RudpPair *pair = arg;
+    if (!rudp_accept(pair->server)) {
+        fprintf(stderr, "Benchmark accept failed\n");
+        return NULL;
+    }
+    while (rudp_recv_stream(pair->server, discard, NULL) >= 0) {
+    }
+    rudp_disconnect(pair->server);
+    return NULL;
+}
+
+static int fill_message(void *ctx, void *data, unsigned int capacity) {
+    RudpPair *pair = ctx;
+    unsigned long long length = MESSAGE_SIZE - pair->offset;
+    if (length > capacity) {
+        length = capacity;
+    }
+    memcpy(data, random_data + pair->offset, length);
+    pair->offset += length;
+    return (int)length;
+}
+
+static int rudp_pair_open(RudpPair *pair, unsigned short port, unsigned short mss) {
+    pair->server = rudp_socket(true, port);
+    pair->client = rudp_socket(false, 0);
+    if (pair->server == NULL || pair->client == NULL) {
+        return -1;
+    }
+    rudp_set_mss(pair->client, mss);
+    if (pthread_create(&pair->receiver, NULL, rudp_receiver, pair) != 0) {
+        fprintf(stderr, "Failed to start the benchmark receiver\n");
+        return -1;
+    }
+    if (!rudp_connect(pair->client, "127.0.0.1", port)) {
+        fprintf(stderr, "Benchmark connect failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void rudp_pair_close(RudpPair *pair) {
+    rudp_disconnect(pair->client);
+    pthread_join(pair->receiver, NULL);
+    rudp_close(pair->client);
+    rudp_close(pair->server);
+}
+
+//one whole message through rudp_send_stream, acknowledged by the receiving thread
+static void bench_rudp_loopback(void *ctx, long iterations) {
+    RudpPair *pair = ctx;
+    for (long i = 0; i < iterations; i++) {
+        pair->offset = 0;
+        if (rudp_send_stream(pair->client, fill_message, pair) != MESSAGE_SIZE) {
+            fprintf(stderr, "Benchmark send failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+//runs batches of growing size until the time is up, the counters and allocations cover just the measured batches
+static void run_bench(const Bench *bench, Counters *counters, long long time_ns) {
+    bench->run(bench->ctx, 1);
+
+    long iterations = 0;
+    long batch = 1;
+    uint64_t values[COUNTERS];
+    unsigned long long allocations_before = allocations;
+    counters_start(counters);
+    long long start = now_ns();
+    long long elapsed;
+    do {
+        bench->run(bench->ctx, batch);
+        iterations += batch;
+        if (batch < MAX_BATCH) {
+            batch *= 2;
+        }
+        elapsed = now_ns() - start;
+    } while (elapsed < time_ns);
+    bool counted = counters_stop(counters, values);
+    unsigned long long allocated = allocations - allocations_before;
+
+    double ns_per_op = (double)elapsed / iterations;
+    printf("%-24s %12.1f", bench->name, ns_per_op);
+    if (bench->bytes > 0) {
+        printf(" %10.1f", bench->bytes / ns_per_op * 1000.0);
+    } else {
+        printf(" %10s", "-");
+    }
+    if (counted && values[0] > 0) {
+        if (bench->bytes > 0) {
+            printf(" %8.2f", (double)bench->bytes * iterations / values[0]);
+        } else {
+            printf(" %8s", "-");
+        }
+        for (int i = 0; i < COUNTERS; i++) {
+            printf(" %12.1f", (double)values[i] / iterations);
+        }
+    } else {
+        printf(" %8s", "-");
+        for (int i = 0; i < COUNTERS; i++) {
+            printf(" %12s", "-");
+        }
+    }
+    printf(" %10.3f\n", (double)allocated / iterations);
+    fflush(stdout);
+}
+
+//times the hot functions of the RUDP API on fixed inputs, see -h
+int main(int argc, char **argv) {
+    const char *filter = NULL;
+    long long time_ms = DEFAULT_TIME_MS;
+    bool usage_ok = argc % 2 == 1;
+    for (int i = 1; usage_ok && i < argc; i += 2) {
+        if (strcmp(argv[i], "-filter") == 0) {
+            filter = argv[i + 1];
+        } else if (strcmp(argv[i], "-time") == 0) {
+            time_ms = atoll(argv[i + 1]);
+            usage_ok = time_ms > 0;
+        } else {
+            usage_ok = false;
+        }
+    }
+    if (!usage_ok) {
+        fprintf(stderr, "Usage: %s [-filter <name part>] [-time <ms per benchmark>]\n", argv[0]);
+        return 1;
+    }
+
+    random_data = util_generate_data(MESSAGE_SIZE, DATAGEN_RANDOM, 1);
+    text_data = util_generate_data(LARGE_SEGMENT, DATAGEN_TEXT, 1);
+    compressed_small = malloc(2 * RUDP_MAX_DATA);
+    compressed_large = malloc(2 * RUDP_MAX_DATA);
+    if (compressed_small == NULL || compressed_large == NULL) {
+        perror("Memory allocation failed");
+        return 1;
+    }
+    compressed_small_size = rudp_compress(text_data, SMALL_SEGMENT, compressed_small, 2 * RUDP_MAX_DATA);
+    compressed_large_size = rudp_compress(text_data, LARGE_SEGMENT, compressed_large, 2 * RUDP_MAX_DATA);
+
+    UdpPair udp_small, udp_large;
+    RudpPair rudp_large, rudp_small;
+    Bench benches[] = {
+        {"checksum/1400", bench_checksum_small, NULL, SMALL_SEGMENT},
+        {"checksum/65400", bench_checksum_large, NULL, LARGE_SEGMENT},
+        {"header/encode", bench_header_encode, NULL, RUDP_WIRE_HEADER_SIZE},
+        {"header/decode", bench_header_decode, NULL, RUDP_WIRE_HEADER_SIZE},
+        {"compress/text-1400", bench_compress_small, NULL, SMALL_SEGMENT},
+        {"compress/text-65400", bench_compress_large, NULL, LARGE_SEGMENT},
+        {"decompress/text-1400", bench_decompress_small, NULL, SMALL_SEGMENT},
+        {"decompress/text-65400", bench_decompress_large, NULL, LARGE_SEGMENT},
+        {"digest/65400", bench_digest, NULL, LARGE_SEGMENT},
+        {"udp/loopback-1400", bench_udp_loopback, &udp_small, SMALL_SEGMENT},
+        {"udp/loopback-65400", bench_udp_loopback, &udp_large, LARGE_SEGMENT},
+        {"rudp/loopback-1M", bench_rudp_loopback, &rudp_large, MESSAGE_SIZE},
+        {"rudp/loopback-1M-mss1400", bench_rudp_loopback, &rudp_small, MESSAGE_SIZE},
+    };
+
+    Counters counters;
+    counters_open(&counters);
+    if (!counters.available) {
+        printf("Hardware counters are not available, perf_event_open was refused.\n");
+    } else if (counters.user_only) {
+        printf("Hardware counters only cover user space, perf_event_paranoid keeps the kernel out.\n");
+    }
+    printf("Counters and allocations cover the benchmarking thread, not the RUDP receiver thread.\n");
+    printf("%-24s %12s %10s %8s", "benchmark", "ns/op", "MB/s", "B/cycle");
+    for (int i = 0; i < COUNTERS; i++) {
+        printf(" %12s", counter_names[i]);
+    }
+    printf(" %10s\n", "allocs/op");
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        Bench *bench = &benches[i];
+        if (filter != NULL && strstr(bench->name, filter) == NULL) {
+            continue;
+        }
+        //sockets are only set up for the benchmarks that run
+        if (bench->ctx == &udp_small && udp_pair_open(&udp_small, SMALL_SEGMENT) < 0) {
+            return 1;
+        }
+        if (bench->ctx == &udp_large && udp_pair_open(&udp_large, LARGE_SEGMENT) < 0) {
+            return 1;
+        }
+        if (bench->ctx == &rudp_large && rudp_pair_open(&rudp_large, BENCH_PORT, RUDP_MAX_DATA) < 0) {
+            return 1;
+        }
+        if (bench->ctx == &rudp_small && rudp_pair_open(&rudp_small, BENCH_PORT + 1, SMALL_SEGMENT) < 0) {
+            return 1;
+        }
+        run_bench(bench, &counters, time_ms * 1000000LL);
+        if (bench->ctx == &udp_small || bench->ctx == &udp_large) {
+            udp_pair_close(bench->ctx);
+        } else if (bench->ctx == &rudp_large || bench->ctx == &rudp_small) {
+            rudp_pair_close(bench->ctx);
+        }
+    }
+
+    free(random_data);
+    free(text_data);
+    free(compressed_small);
+    free(compressed_large);
+    return 0;
+}
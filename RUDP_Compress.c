@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <string.h>
+#include "RUDP_Compress.h"
+
+#define MIN_MATCH 4
+#define HASH_BITS 12 // 4096 entry table, small enough to clear for every segment
+#define LAST_LITERALS 5 // The block ends in at least this many literals
+#define MATCH_FIND_LIMIT 12 // No match starts this close to the end
+#define SKIP_TRIGGER 6 // Misses in a row before the search starts skipping ahead, incompressible data passes quickly
+#define MAX_INPUT 65535
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static unsigned int hash4(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+//end of the match starting at p, compared eight bytes at a time: the first differing byte is found from the XOR of the words
+static const unsigned char *extend_match(const unsigned char *p, const unsigned char *ref, const unsigned char *limit) {
+    while (p + sizeof(uint64_t) <= limit) {
+        uint64_t diff = read64(p) ^ read64(ref);
+        if (diff != 0) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return p + (__builtin_ctzll(diff) >> 3);
+#else
+            return p + (__builtin_clzll(diff) >> 3);
+#endif
+        }
+        p += sizeof(uint64_t);
+        ref += sizeof(uint64_t);
+    }
+    while (p < limit && *p == *ref) {
+        p++;
+        ref++;
+    }
+    return p;
+}
+
+//writes the 255-byte continuation of a length whose 4-bit field is full
+static unsigned char *write_length(unsigned char *op, size_t length) {
+    for (; length >= 255; length -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+//emits one sequence: literals, then a match unless match_length is 0, returns NULL when dst is full
+static unsigned char *write_sequence(unsigned char *op, unsigned char *op_end, const unsigned char *literals, size_t literal_length,
+                                     size_t offset, size_t match_length) {
+    size_t needed = 1 + literal_length + literal_length / 255 + 1 + (match_length > 0 ? 2 + match_length / 255 + 1 : 0);
+    if (needed > (size_t)(op_end - op)) {
+        return NULL;
+    }
+    unsigned char *token = op++;
+    *token = (unsigned char)((literal_length < 15 ? literal_length : 15) << 4);
+    if (literal_length >= 15) {
+        op = write_length(op, literal_length - 15);
+    }
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+    if (match_length == 0) {
+        return op;
+    }
+
+    *op++ = (unsigned char)offset;
+    *op++ = (unsigned char)(offset >> 8);
+    size_t extra = match_length - MIN_MATCH;
+    *token |= (unsigned char)(extra < 15 ? extra : 15);
+    if (extra >= 15) {
+        op = write_length(op, extra - 15);
+    }
+    return op;
+}
+
+// Compresses src into dst, returns the compressed size or 0 when it does not fit in dst_capacity bytes
+int rudp_compress(const void *src, int src_len, void *dst, int dst_capacity) {
+    if (src_len < 0 || src_len > MAX_INPUT || dst_capacity <= 0) {
+        return 0;
+    }
+    const unsigned char *in = src;
+    const unsigned char *end = in + src_len;
+    const unsigned char *anchor = in;
+    unsigned char *op = dst;
+    unsigned char *op_end = op + dst_capacity;
+
+    if (src_len > MATCH_FIND_LIMIT) {
+        uint16_t table[1 << HASH_BITS];
+        memset(table, 0, sizeof(table));
+        const unsigned char *match_limit = end - LAST_LITERALS;
+        const unsigned char *search_limit = end - MATCH_FIND_LIMIT;
+        const unsigned char *ip = in + 1;
+        unsigned int attempts = 1u << SKIP_TRIGGER;
+
+        while (ip < search_limit) {
+            uint32_t sequence = read32(ip);
+            unsigned int h = hash4(sequence);
+            const unsigned char *ref = in + table[h];
+            table[h] = (uint16_t)(ip - in);
+            if (read32(ref) != sequence || ref >= ip) {
+                ip += attempts++ >> SKIP_TRIGGER;
+                continue;
+            }
+            attempts = 1u << SKIP_TRIGGER;
+
+            //grow the match backwards into the pending literals, then forwards
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char *match_end = extend_match(ip + MIN_MATCH, ref + MIN_MATCH, match_limit);
+
+            op = write_sequence(op, op_end, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), (size_t)(match_end - ip));
+            if (op == NULL) {
+                return 0;
+            }
+            ip = match_end;
+            anchor = ip;
+        }
+    }
+
+    op = write_sequence(op, op_end, anchor, (size_t)(end - anchor), 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+    return (int)(op - (unsigned char *)dst);
+}
+
+// Decompresses src into dst, returns the decompressed size or -1 for malformed input or a too small dst
+int rudp_decompress(const void *src, int src_len, void *dst, int dst_capacity) {
+    const unsigned char *ip = src;
+    const unsigned char *end = ip + src_len;
+    unsigned char *out = dst;
+    unsigned char *op = out;
+    unsigned char *op_end = out + dst_capacity;
+
+    while (ip < end) {
+        unsigned int token = *ip++;
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15) {
+            unsigned int byte;
+            do {
+                if (ip >= end) {
+                    return -1;
+                }
+                byte = *ip++;
+                literal_length += byte;
+            } while (byte == 255);
+        }
+        if (literal_length > (size_t)(end - ip) || literal_length > (size_t)(op_end - op)) {
+            return -1;
+        }
+        memcpy(op, ip, literal_length);
+        op += literal_length;
+        ip += literal_length;
+
+        //the last sequence has no match
+        if (ip == end) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out)) {
+            return -1;
+        }
+        size_t match_length = token & 15;
+        if (match_length == 15) {
+            unsigned int byte;
+            do {
+                if (ip >= end) {
+                    return -1;
+                }
+                byte = *ip++;
+                match_length += byte;
+            } while (byte == 255);
+        }
+        match_length += MIN_MATCH;
+        if (match_length > (size_t)(op_end - op)) {
+            return -1;
+        }
+
+        //an offset shorter than the match repeats the bytes just written
+        const unsigned char *ref = op - offset;
+        if (offset >= match_length) {
+            memcpy(op, ref, match_length);
+        } else {
+            for (size_t i = 0; i < match_length; i++) {
+                op[i] = ref[i];
+            }
+        }
+        op += match_length;
+    }
+    return (int)(op - out);
+}
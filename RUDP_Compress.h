@@ -0,0 +1,13 @@
+#ifndef RUDP_COMPRESS_H
+#define RUDP_COMPRESS_H
+
+// A fast LZ77 codec in the LZ4 block format, used for the payload of single RUDP segments.
+// Inputs are at most 65535 bytes, so every match offset fits the format's 16 bits.
+
+// Compresses src into dst, returns the compressed size or 0 when it does not fit in dst_capacity bytes
+int rudp_compress(const void *src, int src_len, void *dst, int dst_capacity);
+
+// Decompresses src into dst, returns the decompressed size or -1 for malformed input or a too small dst
+int rudp_decompress(const void *src, int src_len, void *dst, int dst_capacity);
+
+#endif
@@ -1,20 +1,143 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
 #include <sys/time.h>
 #include <netinet/in.h>
 #include "RUDP_API.h"
 
 #define BUFFER_SIZE 65507
-#define TOTAL_DATA_SIZE 2097152 // 2MB in bytes
+#define MAX_FILE_SIZE (64ULL << 30) // Largest file size a sender may announce, 64 GiB
 
 
+//memory-mapped output file being filled by rudp_recv_stream
+typedef struct {
+    char *map;
+    unsigned long long size;
+    unsigned long long offset;
+} FileCursor;
+
+int deliver_to_file(void *ctx, const void *data, unsigned int length) {
+    FileCursor *cursor = ctx;
+    if (length > cursor->size - cursor->offset) {
+        fprintf(stderr, "Sender sent more than the announced file size.\n");
+        return -1;
+    }
+    memcpy(cursor->map + cursor->offset, data, length);
+    cursor->offset += length;
+    return 0;
+}
+
+//the data is only counted when no output file was given
+int discard_data(void *ctx, const void *data, unsigned int length) {
+    (void)ctx;
+    (void)data;
+    (void)length;
+    return 0;
+}
+
+//receives a file straight into a pre-sized, memory-mapped output file, returns the bytes received or -1.
+//the file is cut back to what arrived, so a failed run does not leave a full-size file behind.
+long long receive_to_file(RUDP_Socket *sock, const char *path, unsigned long long size) {
+    //the size comes from the peer, it must not make us reserve more than the disk can hold
+    if (size > MAX_FILE_SIZE || size > (size_t)-1) {
+        fprintf(stderr, "Announced file size %llu is larger than %llu bytes.\n", size, MAX_FILE_SIZE);
+        return -1;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to open output file");
+        return -1;
+    }
+    struct statvfs fs;
+    if (fstatvfs(fd, &fs) == 0 && size > (unsigned long long)fs.f_bavail * fs.f_frsize) {
+        fprintf(stderr, "Announced file size %llu does not fit in the %llu bytes free.\n", size,
+                (unsigned long long)fs.f_bavail * fs.f_frsize);
+        close(fd);
+        return -1;
+    }
+
+    char *map = NULL;
+    if (size > 0) {
+        //reserve the blocks up front, falling back to a sparse file where fallocate is not supported
+        int err = posix_fallocate(fd, 0, (off_t)size);
+        if (err != 0 && ftruncate(fd, (off_t)size) < 0) {
+            perror("Failed to size output file");
+            close(fd);
+            return -1;
+        }
+
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return -1;
+        }
+    }
+
+    FileCursor cursor = {map, size, 0};
+    long long received = rudp_recv_stream(sock, deliver_to_file, &cursor);
+    if (map != NULL) {
+        munmap(map, size);
+    }
+    if (cursor.offset < size && ftruncate(fd, (off_t)cursor.offset) < 0) {
+        perror("Failed to truncate output file");
+    }
+    close(fd);
+    return received;
+}
+
+//receives a file without keeping any of it, returns the bytes received or -1
+long long receive_and_discard(RUDP_Socket *sock) {
+    return rudp_recv_stream(sock, discard_data, NULL);
+}
+
+//after a run failed: a message that did not match its digest arrived whole and the session goes on, returns 0.
+//anything else leaves the connection in an unknown state, it is closed with a FIN so the sender does not wait on it, returns -1.
+int report_failed_run(RUDP_Socket *sock, const RUDP_Stats *before, int run) {
+    RUDP_Stats stats;
+    rudp_get_stats(sock, &stats);
+    if (stats.digest_mismatches > before->digest_mismatches) {
+        printf(" - Run #%d failed: the data did not match the sender's digest\n", run);
+        return 0;
+    }
+    fprintf(stderr, "Run #%d failed, closing the connection.\n", run);
+    rudp_disconnect(sock);
+    rudp_close(sock);
+    return -1;
+}
+
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    char *output_path = NULL;
+    unsigned int idle_seconds = 0;
+    bool timestamps = false;
+    char *trace_path = NULL;
+    Util_Tuning tuning;
+    util_tuning_init(&tuning);
+    bool usage_ok = argc >= 3 && argc % 2 == 1;
+    for (int i = 3; usage_ok && i < argc; i += 2) {
+        if (strcmp(argv[i], "-o") == 0) {
+            output_path = argv[i + 1];
+        } else if (strcmp(argv[i], "-idle") == 0) {
+            idle_seconds = (unsigned int)atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-timestamps") == 0) {
+            timestamps = strcmp(argv[i + 1], "on") == 0;
+            usage_ok = timestamps || strcmp(argv[i + 1], "off") == 0;
+        } else if (strcmp(argv[i], "-trace") == 0) {
+            trace_path = argv[i + 1];
+        } else {
+            usage_ok = util_tuning_option(&tuning, argv[i], argv[i + 1]) > 0;
+        }
+    }
+    if (!usage_ok) {
+        fprintf(stderr, "Usage: %s -p <port> [-o <file>] [-idle <seconds>] [-timestamps <on|off>] [-trace <file>] " UTIL_TUNING_USAGE "\n", argv[0]);
         return 1;
     }
 
@@ -24,43 +147,41 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    // Create a large buffer to accumulate all received data.
-    char *big_buffer = malloc(TOTAL_DATA_SIZE);
-    if (big_buffer == NULL) {
-        perror("Failed to allocate buffer");
-        exit(EXIT_FAILURE);
-    }
-
     struct timeval start_time, end_time;
     double total_time = 0;
-    unsigned int total_bytes_received = 0;
-    int total_overall = 0;
-
-    
-
-    // // Open a file to save received data
-    // FILE *file = fopen("received_data.bin", "wb");
-    // if (file == NULL) {
-    //     perror("Failed to open file");
-    //     free(big_buffer);
-    //     exit(EXIT_FAILURE);
-    // }
+    unsigned long long total_overall = 0;
+    int failed_runs = 0;
 
     // Create a RUDP socket (server mode)
     RUDP_Socket * server_sock = rudp_socket(true, RECEIVER_PORT);
     if (server_sock == NULL) {
         perror("Socket creation failed");
-        // fclose(file);
-        free(big_buffer);
         exit(EXIT_FAILURE);
     }
 
+    //probe a silent sender three times before giving up on it
+    if (idle_seconds > 0) {
+        rudp_set_keepalive(server_sock, idle_seconds * 1000 / 3, idle_seconds * 1000);
+    }
+
+    if ((timestamps && rudp_set_timestamping(server_sock, true) < 0) || (trace_path != NULL && rudp_set_trace(server_sock, trace_path) < 0)) {
+        rudp_close(server_sock);
+        return 1;
+    }
+
+    //pinned after the trace writer started, so it does not compete with this thread for the CPU
+    rudp_set_tuning(server_sock, &tuning);
+    util_tuning_pin(&tuning);
+    Util_Tuning effective;
+    if (rudp_get_tuning(server_sock, &effective) == 0) {
+        util_tuning_print("Socket tuning", &effective);
+    }
+
     printf("Waiting for RUDP connections..\n");
 
     // Accept incoming connections
     if (!rudp_accept(server_sock)) {
         perror("Accept failed");
-        // fclose(file);
         rudp_close(server_sock);
         exit(EXIT_FAILURE);
     }
@@ -69,79 +190,106 @@ int main(int argc, char **argv) {
 
     
 
-    int expectingEndSignal = 0;  // Flag to determine if we should check for an end signal
     int run = 1;
-    int bytes_received = 1;
-    while (bytes_received) {
-        memset(big_buffer, 0, TOTAL_DATA_SIZE); // Clear the buffer at the start of each connection handling loop.
-        
+    while (1) {
         printf("Waiting for packet for Run #%d...\n", run);
-        gettimeofday(&start_time, NULL);
+        RUDP_Stats before;
+        rudp_get_stats(server_sock, &before);
 
-        // char buffer[BUFFER_SIZE];
-        bytes_received = rudp_recv(server_sock, big_buffer, TOTAL_DATA_SIZE);
-        if (bytes_received < 0) {
-            perror("recvfrom");
-            rudp_close(server_sock);
-            return 1;
+        //every file starts with its size in network byte order, until the sender disconnects
+        unsigned char size_buf[8];
+        int size_received = rudp_recv(server_sock, size_buf, sizeof(size_buf));
+        if (size_received == RUDP_PEER_CLOSED) {
+            printf("Proper termination of the session confirmed.\n");
+            break;
+        }
+        if (size_received < 0) {
+            if (report_failed_run(server_sock, &before, run) < 0) {
+                return 1;
+            }
+            failed_runs++;
+            run++;
+            continue;
+        }
+        if (size_received != sizeof(size_buf)) {
+            printf(" - Run #%d failed: the file size took %d bytes instead of %zu\n", run, size_received, sizeof(size_buf));
+            failed_runs++;
+            run++;
+            continue;
+        }
+        gettimeofday(&start_time, NULL);
+        unsigned long long file_size = 0;
+        for (int i = 0; i < 8; i++) {
+            file_size = (file_size << 8) | size_buf[i];
         }
 
-        // int written = fwrite(big_buffer, 1, bytes_received, file);
-        // if (written < bytes_received) {
-        //     perror("Failed to write to file");
-        //     break;
-        // }
+        long long received = output_path != NULL ? receive_to_file(server_sock, output_path, file_size) : receive_and_discard(server_sock);
+        if (received >= 0 && (unsigned long long)received != file_size) {
+            //the whole message arrived, it just was not the announced size
+            printf(" - Run #%d failed: received %lld bytes instead of %llu\n", run, received, file_size);
+            failed_runs++;
+            run++;
+            continue;
+        }
+        if (received < 0) {
+            if (report_failed_run(server_sock, &before, run) < 0) {
+                return 1;
+            }
+            failed_runs++;
+            run++;
+            continue;
+        }
 
         printf("Received packet for Run #%d...\n", run);
 
-        
-
-        // Process received data...
-
-        total_bytes_received += bytes_received;
-
-        if (total_bytes_received >= (1 << 21)) {
-            expectingEndSignal = 1;
-            gettimeofday(&end_time, NULL);
-            double elapsed_time = (end_time.tv_sec - start_time.tv_sec) * 1000.0;
-            elapsed_time += (end_time.tv_usec - start_time.tv_usec) / 1000.0;
-            double total_bandwidth_fn = (total_bytes_received / (1024 * 1024)) / (elapsed_time / 1000);
-            printf(" - File transfer completed for Run #%d.\n", run);
-            printf(" - Run #%d Data: Time=%.2fms; Speed=%.2fMB/s\n", run, elapsed_time, total_bandwidth_fn);
-            total_time += elapsed_time;
-            run++;
-            printf("Waiting for Sender response...\n");
-            total_overall += total_bytes_received;
-            total_bytes_received = 0;
-            // gettimeofday(&start_time, NULL);
+        gettimeofday(&end_time, NULL);
+        double elapsed_time = (end_time.tv_sec - start_time.tv_sec) * 1000.0;
+        elapsed_time += (end_time.tv_usec - start_time.tv_usec) / 1000.0;
+        double total_bandwidth_fn = (file_size / (1024.0 * 1024.0)) / (elapsed_time / 1000);
+        printf(" - File transfer completed for Run #%d.\n", run);
+        printf(" - Run #%d Data: Time=%.2fms; Speed=%.2fMB/s\n", run, elapsed_time, total_bandwidth_fn);
+        RUDP_Stats stats;
+        rudp_get_stats(server_sock, &stats);
+        if (timestamps) {
+            printf(" - Run #%d Delay: OWD=%lldus (min %lldus, max %lldus); Jitter=%lldus; Kernel->user=%lldus over %llu of %llu segments",
+                   run, stats.owd_us, stats.owd_min_us, stats.owd_max_us, stats.jitter_us, stats.kernel_to_user_us,
+                   stats.kernel_samples, stats.samples);
+            if (stats.hardware_samples > 0) {
+                printf("; NIC->kernel=%lldus", stats.nic_to_kernel_us);
+            }
+            printf("\n");
         }
-
-        //if we get a termination signal we stop transferring
-        if (expectingEndSignal && rudp_recv_end_signal(server_sock) == 1) {
-            printf("Proper termination of the session confirmed.\n");
-            break;
-            // Perform cleanup or state reset here
+        //a sender with -verify on sends a digest with every message, rudp_recv_stream already failed the run on a mismatch
+        if (stats.verified_messages > 0) {
+            printf(" - Run #%d Verified: %llu messages so far matched the sender's digest\n", run, stats.verified_messages);
         }
-        else {
-            printf("Continuing data reception...\n");
+        //damaged and stray packets are dropped and counted, retransmission already made up for them
+        if (stats.corrupt_segments > 0 || stats.unexpected_packets > 0) {
+            printf(" - Run #%d Dropped: %llu corrupt segments, %llu unexpected packets so far\n", run, stats.corrupt_segments,
+                   stats.unexpected_packets);
         }
-
+        total_time += elapsed_time;
+        run++;
+        printf("Waiting for Sender response...\n");
+        total_overall += file_size;
     }
 
-    // Close the file and socket when done
-        // fclose(file);
+    // Close the socket when done
         rudp_disconnect(server_sock);
         // Close the socket
         rudp_close(server_sock);
 
     
     //calculate and print statistics
-    double average_time = total_time / (run - 1);
+    double average_time = total_time / (run - 1 - failed_runs);
     double average_bandwidth = (total_overall / 1024.0 / 1024.0) / (total_time / 1000.0);
     printf("----------------------------------\n");
     printf("Statistics for the entire program:\n");
     printf("- Average time: %.2fms\n", average_time);
     printf("- Average bandwidth: %.2fMB/s\n", average_bandwidth);
+    if (failed_runs > 0) {
+        printf("- Failed runs: %d\n", failed_runs);
+    }
     printf("----------------------------------\n");
     printf("Receiver end.\n");
     return 0;
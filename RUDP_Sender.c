@@ -1,29 +1,123 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
-#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include "RUDP_API.h"
+#include "Util_DataGen.h"
 
+//maps a file read-only so it can be sent without copying it to the heap
+char *map_input_file(const char *path, unsigned long long *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open input file");
+        return NULL;
+    }
 
-char *util_generate_random_data(unsigned int size) {
-    char *buffer = (char *)malloc(size);
-    if (buffer == NULL) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
+        return NULL;
     }
-    srand(time(NULL));
-    for (unsigned int i = 0; i < size; i++)
-        buffer[i] = (char)(rand() % 256);
-    return buffer;
+    *size = (unsigned long long)st.st_size;
+
+    //an empty file has nothing to map
+    if (*size == 0) {
+        close(fd);
+        return "";
+    }
+
+    char *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    madvise(data, *size, MADV_SEQUENTIAL);
+    return data;
+}
+
+//position of the file content already handed to rudp_send_stream
+typedef struct {
+    const char *data;
+    unsigned long long size;
+    unsigned long long offset;
+} FileCursor;
+
+int fill_from_file(void *ctx, void *data, unsigned int capacity) {
+    FileCursor *cursor = ctx;
+    unsigned long long length = cursor->size - cursor->offset;
+    if (length > capacity) {
+        length = capacity;
+    }
+    memcpy(data, cursor->data + cursor->offset, length);
+    cursor->offset += length;
+    return (int)length;
+}
+
+//sends the size of the file followed by its content as a single stream
+int send_file(RUDP_Socket *sock, char *data, unsigned long long size) {
+    //the size goes first, in network byte order
+    unsigned char size_buf[8];
+    for (int i = 0; i < 8; i++) {
+        size_buf[i] = (unsigned char)(size >> (56 - 8 * i));
+    }
+    if (rudp_send(sock, size_buf, sizeof(size_buf)) < 0) {
+        return -1;
+    }
+
+    FileCursor cursor = {data, size, 0};
+    if (rudp_send_stream(sock, fill_from_file, &cursor) < 0) {
+        return -1;
+    }
+    return 0;
 }
 
 int main(int argc, char** argv) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <port> \n", argv[0]);
+    char *input_path = NULL;
+    double rate_mb = 0;
+    unsigned int fec_data = 0, fec_parity = 0;
+    bool compress = false;
+    bool verify = false;
+    char *trace_path = NULL;
+    int data_mode = DATAGEN_RANDOM;
+    unsigned long long seed = 1;
+    Util_Tuning tuning;
+    util_tuning_init(&tuning);
+    bool usage_ok = argc >= 5 && argc % 2 == 1;
+    for (int i = 5; usage_ok && i < argc; i += 2) {
+        if (strcmp(argv[i], "-f") == 0) {
+            input_path = argv[i + 1];
+        } else if (strcmp(argv[i], "-rate") == 0) {
+            rate_mb = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "-compress") == 0) {
+            compress = strcmp(argv[i + 1], "lz") == 0;
+            usage_ok = compress || strcmp(argv[i + 1], "none") == 0;
+        } else if (strcmp(argv[i], "-fec") == 0) {
+            usage_ok = sscanf(argv[i + 1], "%u:%u", &fec_data, &fec_parity) == 2;
+        } else if (strcmp(argv[i], "-trace") == 0) {
+            trace_path = argv[i + 1];
+        } else if (strcmp(argv[i], "-verify") == 0) {
+            verify = strcmp(argv[i + 1], "on") == 0;
+            usage_ok = verify || strcmp(argv[i + 1], "off") == 0;
+        } else if (strcmp(argv[i], "-data") == 0) {
+            data_mode = util_datagen_mode(argv[i + 1]);
+            usage_ok = data_mode >= 0;
+        } else if (strcmp(argv[i], "-seed") == 0) {
+            usage_ok = sscanf(argv[i + 1], "%llu", &seed) == 1;
+        } else {
+            usage_ok = util_tuning_option(&tuning, argv[i], argv[i + 1]) > 0;
+        }
+    }
+    if (!usage_ok) {
+        fprintf(stderr, "Usage: %s -ip <address|host> -p <port> [-f <file>] [-rate <MB/s>] [-fec <data>:<parity>] [-compress <lz|none>] [-verify <on|off>] [-trace <file>] [-data <random|text|pattern|zero>] [-seed <n>] " UTIL_TUNING_USAGE "\n", argv[0]);
         return 1;
     }
 
@@ -40,32 +134,56 @@ int main(int argc, char** argv) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
-    
 
-    struct sockaddr_in server_address;
-    memset(&server_address, 0, sizeof(server_address));
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = inet_addr(SERVER_IP);
-    server_address.sin_port = htons(SERVER_PORT);
+    //without a fixed rate the segments are paced at a full window per round trip
+    if (rate_mb > 0) {
+        rudp_set_pacing_rate(sock, (unsigned long long)(rate_mb * 1024 * 1024));
+    }
+    if (rudp_set_fec(sock, fec_data, fec_parity) < 0) {
+        fprintf(stderr, "Invalid FEC setting %u:%u\n", fec_data, fec_parity);
+        rudp_close(sock);
+        return 1;
+    }
+    rudp_set_compression(sock, compress ? RUDP_COMPRESSION_LZ : RUDP_COMPRESSION_NONE);
+    rudp_set_verify(sock, verify);
+    if (trace_path != NULL && rudp_set_trace(sock, trace_path) < 0) {
+        rudp_close(sock);
+        return 1;
+    }
+
+    //pinned after the trace writer started, so it does not compete with this thread for the CPU
+    rudp_set_tuning(sock, &tuning);
+    util_tuning_pin(&tuning);
+    Util_Tuning effective;
+    if (rudp_get_tuning(sock, &effective) == 0) {
+        util_tuning_print("Socket tuning", &effective);
+    }
 
     // Connection establishment for RUDP
-    if (rudp_connect(sock, SERVER_IP, SERVER_PORT) < 0) {
+    if (!rudp_connect(sock, SERVER_IP, SERVER_PORT)) {
         fprintf(stderr, "Connection establishment failed\n");
         rudp_close(sock);
         exit(EXIT_FAILURE);
     }
 
-    // Generate random data
-        unsigned int file_size = 2 * 1024 * 1024; // 2MB
-        char *data = util_generate_random_data(file_size);
+    // Map the input file, or generate test data when no file was given
+    unsigned long long file_size = 2 * 1024 * 1024; // 2MB
+    char *data;
+    if (input_path != NULL) {
+        data = map_input_file(input_path, &file_size);
+        if (data == NULL) {
+            rudp_close(sock);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        data = util_generate_data(file_size, data_mode, seed);
+    }
 
     while (1) {
         // Send the data
-        int bytes_sent = rudp_send(sock, data, file_size);
-        if (bytes_sent < 0) {
+        if (send_file(sock, data, file_size) < 0) {
             perror("Send failed");
-            free(data);
-            exit(EXIT_FAILURE);
+            break;
         }
 
 
@@ -78,16 +196,16 @@ int main(int argc, char** argv) {
         }
 
         if (choice != 'y'){
-            // free(data);
-            if (rudp_send_end_signal(sock) < 0) {
-                fprintf(stderr, "Failed to send end signal.\n");
-            }
             printf("Sender chose to not send the file again.\n");  
             break; // Exit the loop
         }
     }
     // Cleanup
-    free(data);
+    if (input_path == NULL) {
+        free(data);
+    } else if (file_size > 0) {
+        munmap(data, file_size);
+    }
     rudp_disconnect(sock);
     rudp_close(sock);
 
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include "RUDP_Trace.h"
+
+#define TRACE_RING_EVENTS 65536 // Events the ring holds, a power of two so a position masks to its slot
+#define TRACE_RING_MASK (TRACE_RING_EVENTS - 1)
+#define TRACE_IDLE_SLEEP_NS 1000000 // How long the writer sleeps when the ring is empty
+#define CACHE_LINE_SIZE 64
+
+//head and tail only ever grow, each is written by one side and sits on its own cache line
+struct RUDP_Trace {
+    uint64_t head __attribute__((aligned(CACHE_LINE_SIZE))); // Next event the protocol thread writes
+    uint64_t dropped; // Events lost to a full ring, only touched by the protocol thread
+    uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE))); // Next event the writer takes
+    int stop __attribute__((aligned(CACHE_LINE_SIZE))); // Set once no more events come
+    FILE *file;
+    pthread_t writer;
+    RUDP_TraceEvent *ring;
+};
+
+//writes out whatever the protocol thread published, until it stopped and everything is out
+static void *trace_writer(void *arg) {
+    RUDP_Trace *trace = arg;
+    uint64_t tail = trace->tail;
+    for (;;) {
+        //stop is read before head, so an empty ring after stop really is the end
+        bool stopping = __atomic_load_n(&trace->stop, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (stopping) {
+                break;
+            }
+            //caught up, what is written so far survives the process being killed
+            fflush(trace->file);
+            struct timespec idle = {0, TRACE_IDLE_SLEEP_NS};
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        //up to the end of the ring at once, the rest on the next round
+        uint64_t start = tail & TRACE_RING_MASK;
+        uint64_t count = head - tail;
+        if (count > TRACE_RING_EVENTS - start) {
+            count = TRACE_RING_EVENTS - start;
+        }
+        fwrite(&trace->ring[start], sizeof(RUDP_TraceEvent), count, trace->file);
+        tail += count;
+        __atomic_store_n(&trace->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    if (trace->dropped > 0) {
+        RUDP_TraceEvent event;
+        memset(&event, 0, sizeof(event));
+        event.type = RUDP_TRACE_DROPPED;
+        event.value = trace->dropped;
+        fwrite(&event, sizeof(event), 1, trace->file);
+    }
+    return NULL;
+}
+
+// Creates the trace file and starts its writer thread
+RUDP_Trace *rudp_trace_open(const char *path) {
+    RUDP_Trace *trace = aligned_alloc(CACHE_LINE_SIZE, (sizeof(RUDP_Trace) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1));
+    if (trace == NULL) {
+        perror("Trace allocation failed");
+        return NULL;
+    }
+    memset(trace, 0, sizeof(*trace));
+    trace->ring = malloc(TRACE_RING_EVENTS * sizeof(RUDP_TraceEvent));
+    if (trace->ring == NULL) {
+        perror("Trace allocation failed");
+        free(trace);
+        return NULL;
+    }
+    trace->file = fopen(path, "wb");
+    if (trace->file == NULL) {
+        perror("Failed to open trace file");
+        free(trace->ring);
+        free(trace);
+        return NULL;
+    }
+
+    RUDP_TraceFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RUDP_TRACE_MAGIC, sizeof(header.magic));
+    header.version = RUDP_TRACE_VERSION;
+    header.event_size = sizeof(RUDP_TraceEvent);
+    fwrite(&header, sizeof(header), 1, trace->file);
+
+    int err = pthread_create(&trace->writer, NULL, trace_writer, trace);
+    if (err != 0) {
+        fprintf(stderr, "Failed to start trace writer: %s\n", strerror(err));
+        fclose(trace->file);
+        free(trace->ring);
+        free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+// Appends an event, the writer sees it once head moves past it
+void rudp_trace_push(RUDP_Trace *trace, const RUDP_TraceEvent *event) {
+    uint64_t head = trace->head;
+    if (head - __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE) == TRACE_RING_EVENTS) {
+        trace->dropped++;
+        return;
+    }
+    trace->ring[head & TRACE_RING_MASK] = *event;
+    __atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Stops the writer once it drained the ring and closes the file
+void rudp_trace_close(RUDP_Trace *trace) {
+    if (trace == NULL) {
+        return;
+    }
+    __atomic_store_n(&trace->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(trace->writer, NULL);
+    if (fclose(trace->file) != 0) {
+        perror("Failed to write trace file");
+    }
+    free(trace->ring);
+    free(trace);
+}
+
+// Name of an event type for printing
+const char *rudp_trace_type_name(uint16_t type) {
+    switch (type) {
+        case RUDP_TRACE_SEND: return "send";
+        case RUDP_TRACE_PARITY: return "parity";
+        case RUDP_TRACE_RETRANSMIT: return "retransmit";
+        case RUDP_TRACE_ACK: return "ack";
+        case RUDP_TRACE_DUP_ACK: return "dup_ack";
+        case RUDP_TRACE_TIMEOUT: return "timeout";
+        case RUDP_TRACE_RATE: return "rate";
+        case RUDP_TRACE_RECV: return "recv";
+        case RUDP_TRACE_FEC_REBUILD: return "fec_rebuild";
+        case RUDP_TRACE_DROPPED: return "dropped";
+        default: return "unknown";
+    }
+}
+
+// Name of a reason for printing, empty for none
+const char *rudp_trace_reason_name(uint16_t reason) {
+    switch (reason) {
+        case RUDP_TRACE_REASON_NONE: return "";
+        case RUDP_TRACE_REASON_TIMEOUT: return "timeout";
+        case RUDP_TRACE_REASON_DUP_ACKS: return "dup_acks";
+        case RUDP_TRACE_REASON_PARTIAL_ACK: return "partial_ack";
+        case RUDP_TRACE_REASON_IN_ORDER: return "in_order";
+        case RUDP_TRACE_REASON_HELD: return "held";
+        case RUDP_TRACE_REASON_DISCARDED: return "discarded";
+        default: return "unknown";
+    }
+}
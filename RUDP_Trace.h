@@ -0,0 +1,71 @@
+#ifndef RUDP_TRACE_H
+#define RUDP_TRACE_H
+
+#include <stdint.h>
+
+// A low-overhead event trace of RUDP connections. The protocol thread appends fixed-size events to a
+// lock-free single-producer ring, a writer thread drains it into a binary file, read back by RUDP_TraceDump.
+// The file is a RUDP_TraceFileHeader followed by RUDP_TraceEvent records, in the byte order of the machine that wrote it.
+
+#define RUDP_TRACE_MAGIC "RUDPTRC1"
+#define RUDP_TRACE_VERSION 1
+
+// What an event records, the fields it fills in are listed with it
+typedef enum {
+    RUDP_TRACE_SEND = 1,     // A segment sent for the first time: seq, length, window = bytes in flight, value = pacing rate
+    RUDP_TRACE_PARITY,       // An FEC parity: seq = block start, length = segments in the block, value = parity group
+    RUDP_TRACE_RETRANSMIT,   // A segment sent again: seq, length, window = peer window, reason
+    RUDP_TRACE_ACK,          // An ACK that advanced the send window: seq = new base, window = peer window, value = smoothed RTT
+    RUDP_TRACE_DUP_ACK,      // An ACK repeating the base: seq = base, window = peer window, value = duplicates in a row
+    RUDP_TRACE_TIMEOUT,      // The retransmission timer expired: seq = base, window = bytes in flight, value = backed off RTO
+    RUDP_TRACE_RATE,         // The pacing rate changed: value = bytes per second, 0 for unpaced
+    RUDP_TRACE_RECV,         // A data segment arrived: seq, length, window = advertised capacity, reason
+    RUDP_TRACE_FEC_REBUILD,  // A lost segment was rebuilt from a parity: seq
+    RUDP_TRACE_DROPPED,      // Written last: value = events lost because the ring was full
+} RUDP_TraceType;
+
+// Why a segment was retransmitted or what became of a received one
+typedef enum {
+    RUDP_TRACE_REASON_NONE = 0,
+    RUDP_TRACE_REASON_TIMEOUT,     // Retransmitted after the RTO expired
+    RUDP_TRACE_REASON_DUP_ACKS,    // Fast retransmission after repeated ACKs
+    RUDP_TRACE_REASON_PARTIAL_ACK, // The next gap shown by an ACK during recovery
+    RUDP_TRACE_REASON_IN_ORDER,    // Delivered right away
+    RUDP_TRACE_REASON_HELD,        // Kept in the reorder ring past a gap
+    RUDP_TRACE_REASON_DISCARDED,   // A duplicate, or too far ahead to keep
+} RUDP_TraceReason;
+
+typedef struct {
+    char magic[8];       // RUDP_TRACE_MAGIC
+    uint32_t version;    // RUDP_TRACE_VERSION
+    uint32_t event_size; // sizeof(RUDP_TraceEvent)
+} RUDP_TraceFileHeader;
+
+typedef struct {
+    uint64_t time_us;  // Monotonic clock when it happened
+    uint64_t value;    // Depends on the type
+    uint32_t conn_id;  // Connection it belongs to
+    uint32_t seq;      // Segment sequence number
+    uint32_t length;   // Bytes on the wire
+    uint32_t window;   // Depends on the type
+    uint16_t type;     // RUDP_TRACE_*
+    uint16_t reason;   // RUDP_TRACE_REASON_*
+    uint32_t reserved;
+} RUDP_TraceEvent;
+
+typedef struct RUDP_Trace RUDP_Trace;
+
+// Creates the trace file and starts its writer thread, returns NULL on failure
+RUDP_Trace *rudp_trace_open(const char *path);
+
+// Appends an event without blocking or allocating, it is only counted when the ring is full
+void rudp_trace_push(RUDP_Trace *trace, const RUDP_TraceEvent *event);
+
+// Lets the writer drain the ring, then stops it and closes the file
+void rudp_trace_close(RUDP_Trace *trace);
+
+// Name of an event type or a reason for printing
+const char *rudp_trace_type_name(uint16_t type);
+const char *rudp_trace_reason_name(uint16_t reason);
+
+#endif
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "RUDP_Trace.h"
+
+//prints a trace file written by rudp_set_trace as CSV, times relative to the first event
+int main(int argc, char **argv) {
+    if (argc != 2 && !(argc == 4 && strcmp(argv[2], "-o") == 0)) {
+        fprintf(stderr, "Usage: %s <trace file> [-o <csv file>]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        perror("Failed to open trace file");
+        return 1;
+    }
+    FILE *out = stdout;
+    if (argc == 4 && (out = fopen(argv[3], "w")) == NULL) {
+        perror("Failed to open output file");
+        fclose(in);
+        return 1;
+    }
+
+    int result = 1;
+    RUDP_TraceFileHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, RUDP_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s is not a RUDP trace.\n", argv[1]);
+        goto done;
+    }
+    if (header.version != RUDP_TRACE_VERSION || header.event_size != sizeof(RUDP_TraceEvent)) {
+        fprintf(stderr, "Unsupported trace version %u with %u byte events.\n", header.version, header.event_size);
+        goto done;
+    }
+
+    fprintf(out, "time_us,conn_id,event,reason,seq,length,window,value\n");
+    RUDP_TraceEvent event;
+    uint64_t first_us = 0;
+    unsigned long long events = 0;
+    while (fread(&event, sizeof(event), 1, in) == 1) {
+        if (events++ == 0) {
+            first_us = event.time_us;
+        }
+        if (event.type == RUDP_TRACE_DROPPED) {
+            fprintf(stderr, "The trace is missing %" PRIu64 " events, the ring was full.\n", event.value);
+            continue;
+        }
+        fprintf(out, "%" PRIu64 ",%08x,%s,%s,%u,%u,%u,%" PRIu64 "\n", event.time_us - first_us, event.conn_id,
+                rudp_trace_type_name(event.type), rudp_trace_reason_name(event.reason), event.seq, event.length, event.window, event.value);
+    }
+    result = 0;
+
+done:
+    fclose(in);
+    if (out != stdout && fclose(out) != 0) {
+        perror("Failed to write output file");
+        result = 1;
+    }
+    return result;
+}
@@ -1,19 +1,360 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 #include <netinet/tcp.h>
+#include "Util_Digest.h"
+#include "Util_Tune.h"
 
 #define MAX_CLIENTS 1
 #define BUFFER_SIZE 1024
 
+//multi-client mode settings
+#define MULTI_BACKLOG SOMAXCONN
+#define MULTI_MAX_EVENTS 64
+#define MULTI_BUFFER_SIZE 65536
+#define FILE_SIZE (1 << 21)
+#define DIGEST_SIZE 8 // XXH64 digest a sender with -verify on sends after every file
+
+//splits what a sender pushes into files, checking each file against the digest after it when verifying
+typedef struct {
+    int verify;
+    unsigned long long file_bytes; // Bytes of the current file received so far
+    Util_Digest digest;
+    unsigned char trailer[DIGEST_SIZE];
+    unsigned int trailer_bytes;
+    int mismatches; // Files that did not match their digest
+    FILE *output; // Where the data of each file is written, over the previous one, NULL to discard it
+} FileTracker;
+
+//per-connection state for the multi-client mode
+typedef struct Connection {
+    int fd;
+    int id;
+    char peer[INET6_ADDRSTRLEN];
+    struct timeval start_time;
+    unsigned long long bytes_received;
+    FileTracker files;
+    int runs;
+    struct Connection *prev; // Neighbours in the list of open connections
+    struct Connection *next;
+} Connection;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_sigint(int signum) {
+    (void)signum;
+    stop_requested = 1;
+}
+
+static double elapsed_ms(const struct timeval *start, const struct timeval *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_usec - start->tv_usec) / 1000.0;
+}
+
+static void tracker_init(FileTracker *tracker, int verify) {
+    memset(tracker, 0, sizeof(*tracker));
+    tracker->verify = verify;
+    util_digest_init(&tracker->digest, 0);
+}
+
+//consumes the next received bytes, returns how many files they completed
+static int track_files(FileTracker *tracker, const char *data, size_t length) {
+    int files = 0;
+    while (length > 0) {
+        if (tracker->file_bytes < FILE_SIZE) {
+            size_t take = FILE_SIZE - tracker->file_bytes < length ? FILE_SIZE - tracker->file_bytes : length;
+            if (tracker->verify) {
+                util_digest_update(&tracker->digest, data, take);
+            }
+            if (tracker->output != NULL) {
+                if (tracker->file_bytes == 0) {
+                    rewind(tracker->output);
+                }
+                fwrite(data, 1, take, tracker->output);
+            }
+            tracker->file_bytes += take;
+            data += take;
+            length -= take;
+            if (tracker->file_bytes == FILE_SIZE && !tracker->verify) {
+                tracker->file_bytes = 0;
+                files++;
+            }
+            continue;
+        }
+
+        //the file is complete, its digest follows in network byte order
+        size_t take = DIGEST_SIZE - tracker->trailer_bytes < length ? DIGEST_SIZE - tracker->trailer_bytes : length;
+        memcpy(tracker->trailer + tracker->trailer_bytes, data, take);
+        tracker->trailer_bytes += take;
+        data += take;
+        length -= take;
+        if (tracker->trailer_bytes == DIGEST_SIZE) {
+            uint64_t expected = 0;
+            for (int i = 0; i < DIGEST_SIZE; i++) {
+                expected = (expected << 8) | tracker->trailer[i];
+            }
+            if (util_digest_final(&tracker->digest) != expected) {
+                fprintf(stderr, "File digest mismatch, the data received is not what was sent.\n");
+                tracker->mismatches++;
+            }
+            tracker->file_bytes = 0;
+            tracker->trailer_bytes = 0;
+            util_digest_init(&tracker->digest, 0);
+            files++;
+        }
+    }
+    return files;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+//prints the statistics of a single connection once its sender closed it
+static void print_connection_stats(const Connection *conn) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    double elapsed_time = elapsed_ms(&conn->start_time, &now);
+    double speed = elapsed_time > 0 ? (conn->bytes_received / (1024.0 * 1024.0)) / (elapsed_time / 1000) : 0;
+    printf(" - Connection #%d (%s) closed: Runs=%d; Bytes=%llu; Time=%.2fms; Speed=%.2fMB/s",
+           conn->id, conn->peer, conn->runs, conn->bytes_received, elapsed_time, speed);
+    if (conn->files.verify) {
+        printf("; Mismatches=%d", conn->files.mismatches);
+    }
+    printf("\n");
+}
+
+//takes a connection off epoll and the open list, closes its socket and frees it
+static void close_connection(int epoll_fd, Connection **open, Connection *conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    print_connection_stats(conn);
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        *open = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    free(conn);
+}
+
+//serves many senders at once using epoll, until SIGINT is received
+static int run_multi_client(int sock, int verify) {
+    if (set_nonblocking(sock) < 0) {
+        perror("fcntl(2)");
+        return 1;
+    }
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1(2)");
+        return 1;
+    }
+
+    //the listening socket is registered with a NULL pointer so it can be told apart from clients
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) < 0) {
+        perror("epoll_ctl(2)");
+        close(epoll_fd);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigint;
+    sigaction(SIGINT, &sa, NULL);
+
+    //aggregate statistics
+    struct timeval first_accept = {0, 0}, last_close = {0, 0};
+    unsigned long long total_bytes = 0;
+    int total_runs = 0;
+    int total_mismatches = 0;
+    int accepted = 0;
+    int active = 0;
+    int peak_active = 0;
+    Connection *open = NULL; // Every connection still open, closed on the way out
+
+    char *buffer = malloc(MULTI_BUFFER_SIZE);
+    if (buffer == NULL) {
+        perror("Failed to allocate buffer");
+        close(epoll_fd);
+        return 1;
+    }
+
+    printf("Waiting for TCP connections (multi-client mode, Ctrl+C to stop)...\n");
+
+    struct epoll_event events[MULTI_MAX_EVENTS];
+    while (!stop_requested) {
+        int ready = epoll_wait(epoll_fd, events, MULTI_MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait(2)");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            Connection *conn = events[i].data.ptr;
+
+            //new senders are waiting on the listening socket
+            if (conn == NULL) {
+                while (1) {
+                    struct sockaddr_storage sender;
+                    socklen_t sender_len = sizeof(sender);
+                    int client_sock = accept4(sock, (struct sockaddr *)&sender, &sender_len, SOCK_NONBLOCK);
+                    if (client_sock < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                            perror("accept4(2)");
+                        }
+                        break;
+                    }
+
+                    Connection *new_conn = calloc(1, sizeof(Connection));
+                    if (new_conn == NULL) {
+                        perror("Failed to allocate connection");
+                        close(client_sock);
+                        continue;
+                    }
+                    new_conn->fd = client_sock;
+                    new_conn->id = ++accepted;
+                    tracker_init(&new_conn->files, verify);
+                    if (sender.ss_family == AF_INET6) {
+                        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&sender)->sin6_addr, new_conn->peer, sizeof(new_conn->peer));
+                    } else {
+                        inet_ntop(AF_INET, &((struct sockaddr_in *)&sender)->sin_addr, new_conn->peer, sizeof(new_conn->peer));
+                    }
+                    gettimeofday(&new_conn->start_time, NULL);
+                    if (accepted == 1) {
+                        first_accept = new_conn->start_time;
+                    }
+
+                    event.events = EPOLLIN;
+                    event.data.ptr = new_conn;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &event) < 0) {
+                        perror("epoll_ctl(2)");
+                        close(client_sock);
+                        free(new_conn);
+                        continue;
+                    }
+
+                    new_conn->next = open;
+                    if (open != NULL) {
+                        open->prev = new_conn;
+                    }
+                    open = new_conn;
+                    active++;
+                    if (active > peak_active) {
+                        peak_active = active;
+                    }
+                    printf("Sender #%d connected from %s (%d active).\n", new_conn->id, new_conn->peer, active);
+                }
+                continue;
+            }
+
+            //drain everything the sender has for us right now
+            int closed = 0;
+            while (1) {
+                ssize_t bytes_received = recv(conn->fd, buffer, MULTI_BUFFER_SIZE, 0);
+                if (bytes_received > 0) {
+                    conn->bytes_received += bytes_received;
+                    total_bytes += bytes_received;
+                    //count every complete file the sender pushed through this connection
+                    int mismatches = conn->files.mismatches;
+                    int files = track_files(&conn->files, buffer, bytes_received);
+                    conn->runs += files;
+                    total_runs += files;
+                    total_mismatches += conn->files.mismatches - mismatches;
+                    continue;
+                }
+                if (bytes_received == 0) {
+                    closed = 1;
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    perror("recv");
+                    closed = 1;
+                }
+                break;
+            }
+
+            if (closed) {
+                gettimeofday(&last_close, NULL);
+                close_connection(epoll_fd, &open, conn);
+                active--;
+            }
+        }
+    }
+
+    //senders still connected when we stopped
+    while (open != NULL) {
+        close_connection(epoll_fd, &open, open);
+    }
+    free(buffer);
+    close(epoll_fd);
+
+    //statistics
+    printf("----------------------------------\n");
+    printf("Statistics for the entire program:\n");
+    printf("- Senders served: %d (peak %d concurrent, %d open at shutdown)\n", accepted, peak_active, active);
+    printf("- Files received: %d\n", total_runs);
+    if (verify) {
+        printf("- Files not matching their digest: %d\n", total_mismatches);
+    }
+    printf("- Total bytes received: %llu\n", total_bytes);
+    if (accepted > 0 && active < accepted) {
+        double wall_time = elapsed_ms(&first_accept, &last_close);
+        if (wall_time > 0) {
+            printf("- Aggregate bandwidth: %.2fMB/s\n", (total_bytes / (1024.0 * 1024.0)) / (wall_time / 1000));
+        }
+    }
+    printf("----------------------------------\n");
+    printf("Receiver end.\n");
+    return 0;
+}
+
 int main(int argc, char **argv) {
-    //checking that the number of arguments is 5
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <port> <algorithm>\n", argv[0]);
+    //checking that the 5 required arguments are there, followed by optional -multi, -verify, -o and tuning pairs
+    Util_Tuning tuning;
+    util_tuning_init(&tuning);
+    int multi_client = 0;
+    int verify = 0;
+    char *output_path = NULL;
+    int usage_ok = argc >= 5 && argc % 2 == 1;
+    for (int i = 5; usage_ok && i < argc; i += 2) {
+        if (strcmp(argv[i], "-multi") == 0) {
+            multi_client = strcmp(argv[i + 1], "on") == 0;
+            usage_ok = multi_client || strcmp(argv[i + 1], "off") == 0;
+        } else if (strcmp(argv[i], "-verify") == 0) {
+            verify = strcmp(argv[i + 1], "on") == 0;
+            usage_ok = verify || strcmp(argv[i + 1], "off") == 0;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            output_path = argv[i + 1];
+        } else {
+            usage_ok = util_tuning_option(&tuning, argv[i], argv[i + 1]) > 0;
+        }
+    }
+    //the senders of the multi-client mode would all write over the same file
+    if (multi_client && output_path != NULL) {
+        usage_ok = 0;
+    }
+    if (!usage_ok) {
+        fprintf(stderr, "Usage: %s -p <port> -algo <algorithm> [-multi <on|off>] [-verify <on|off>] [-o <file>, without -multi] " UTIL_TUNING_USAGE "\n", argv[0]);
         return 1;
     }
     
@@ -36,19 +377,30 @@ int main(int argc, char **argv) {
     //parameters for the statistics
     struct timeval start_time, end_time;
     double total_time = 0;
-    unsigned int total_bytes_received = 0;
+    FileTracker tracker;
+    tracker_init(&tracker, verify);
 
     int sock = -1;
-    struct sockaddr_in sender;
-    struct sockaddr_in receiver;
+    struct sockaddr_storage sender;
+    struct sockaddr_in6 receiver;
     socklen_t sender_len = sizeof(sender);
     memset(&sender, 0, sizeof(sender));
     memset(&receiver, 0, sizeof(receiver));
 
     printf("Starting Receiver....\n");
 
-    //creating the server socket
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    //creating the server socket, dual-stack so IPv4 senders connect too, or plain IPv4 where the host has no IPv6
+    int family = AF_INET6;
+    sock = socket(AF_INET6, SOCK_STREAM, 0);
+    int v6only = 0;
+    if (sock != -1 && setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) != 0) {
+        close(sock);
+        sock = -1;
+    }
+    if (sock == -1) {
+        family = AF_INET;
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+    }
     if (sock == -1) {
         perror("socket(2)");
         return 1;
@@ -61,24 +413,53 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    receiver.sin_addr.s_addr = INADDR_ANY;
-    receiver.sin_family = AF_INET;
-    receiver.sin_port = htons(RECEIVER_PORT);
+    //accepted sockets inherit the listening socket's buffers, busy polling and marking
+    util_tuning_apply(sock, &tuning);
+    util_tuning_pin(&tuning);
+    Util_Tuning effective;
+    if (util_tuning_effective(sock, &effective) == 0) {
+        util_tuning_print("Socket tuning", &effective);
+    }
+
+    //any address of the socket's family
+    struct sockaddr_in receiver4;
+    memset(&receiver4, 0, sizeof(receiver4));
+    receiver4.sin_addr.s_addr = INADDR_ANY;
+    receiver4.sin_family = AF_INET;
+    receiver4.sin_port = htons(RECEIVER_PORT);
+    receiver.sin6_addr = in6addr_any;
+    receiver.sin6_family = AF_INET6;
+    receiver.sin6_port = htons(RECEIVER_PORT);
 
     //connecting the listening socket to the adress
-    if (bind(sock, (struct sockaddr *)&receiver, sizeof(receiver)) < 0) {
+    int bound = family == AF_INET6 ? bind(sock, (struct sockaddr *)&receiver, sizeof(receiver))
+                                   : bind(sock, (struct sockaddr *)&receiver4, sizeof(receiver4));
+    if (bound < 0) {
         perror("bind(2)");
         close(sock);
         return 1;
     }
 
     //waiting for connection requests
-    if (listen(sock, MAX_CLIENTS) < 0) {
+    if (listen(sock, multi_client ? MULTI_BACKLOG : MAX_CLIENTS) < 0) {
         perror("listen(2)");
         close(sock);
         return 1;
     }
 
+    if (multi_client) {
+        int result = run_multi_client(sock, verify);
+        close(sock);
+        return result;
+    }
+
+    //with -o every file received is written there, each one over the last
+    if (output_path != NULL && (tracker.output = fopen(output_path, "wb")) == NULL) {
+        perror("Failed to open output file");
+        close(sock);
+        return 1;
+    }
+
     printf("Waiting for TCP connections...\n");
     int total = 0;
     int run = 1;
@@ -96,17 +477,8 @@ int main(int argc, char **argv) {
         //taking time sample for the statistics later
         gettimeofday(&start_time, NULL);
 
-        //creating an empty file that to it we will write the sent file
-        FILE *file = fopen("received_file.txt", "wb");
-        if (file == NULL) {
-            perror("File opening failed");
-            exit(EXIT_FAILURE);
-        }
-
-        total_bytes_received = 0; // Reset total bytes received for this run
         char buffer[BUFFER_SIZE];
         int bytes_received = 1;
-        unsigned int expectedBytes = 1<<21;
         //while we are still getting data from the client
         while(bytes_received){
             bytes_received = recv(client_sock, buffer, BUFFER_SIZE, 0);
@@ -117,27 +489,24 @@ int main(int argc, char **argv) {
                 // Socket closed by sender
                 break;
             }
-            total_bytes_received += bytes_received;
             total += bytes_received;
-            //we got an entire file
-            if(total_bytes_received >= expectedBytes){
+            //we got an entire file, and its digest when verifying
+            for (int files = track_files(&tracker, buffer, bytes_received); files > 0; files--) {
                 // Print statistics and reset for next file
                 gettimeofday(&end_time, NULL);
                 double elapsed_time = (end_time.tv_sec - start_time.tv_sec) * 1000.0;
                 elapsed_time += (end_time.tv_usec - start_time.tv_usec) / 1000.0;
-                double total_bandwidth_fn = (total_bytes_received / (1024 * 1024)) / (elapsed_time / 1000); // Convert bytes/ms to MB/s
+                double total_bandwidth_fn = (FILE_SIZE / (1024 * 1024)) / (elapsed_time / 1000); // Convert bytes/ms to MB/s
                 printf(" - File transfer completed for Run #%d.\n", run);
                 printf(" - Run #%d Data: Time=%.2fms; Speed=%.2fMB/s\n", run, elapsed_time, total_bandwidth_fn);
                 total_time += elapsed_time;
                 run++;
                 printf("Waiting for Sender response...\n");
-                total_bytes_received = 0; // Reset for next chunk
                 gettimeofday(&start_time, NULL);
             }
 
         }
 
-        fclose(file);
         close(client_sock);
 
 
@@ -151,6 +520,10 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (tracker.output != NULL && fclose(tracker.output) != 0) {
+        perror("Failed to write output file");
+    }
+
     //statistics
     double average_time = total_time / (run - 1); // Exclude the run when exit message was received
     double total_bandwidth = (total / (1024 * 1024)) / (total_time / 1000); // Convert bytes/ms to MB/s
@@ -159,6 +532,9 @@ int main(int argc, char **argv) {
     printf("Statistics for the entire program:\n");
     printf("- Average time: %.2fms\n", average_time);
     printf("- Total average bandwidth: %.2fMB/s\n", total_bandwidth);
+    if (verify) {
+        printf("- Files not matching their digest: %d\n", tracker.mismatches);
+    }
     printf("----------------------------------\n");
     printf("Receiver end.\n");
     return 0;
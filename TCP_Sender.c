@@ -1,35 +1,59 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
-#include <time.h>
+#include <netdb.h>
 #include <netinet/tcp.h>
+#include "Util_DataGen.h"
+#include "Util_Digest.h"
+#include "Util_Tune.h"
 
 
 #define BUFFER_SIZE 1024
 
-//given function in the assignment file. generates a random file with a given size.
-char *util_generate_random_data(unsigned int size) {
-    char *buffer = (char *)malloc(size);
-    if (buffer == NULL) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+
+//sends all size bytes at data, BUFFER_SIZE at a time and picking up after partial sends, returns -1 on failure
+static int send_all(int sock, const char *data, size_t size) {
+    size_t sent = 0;
+    while (sent < size) {
+        size_t length = size - sent < BUFFER_SIZE ? size - sent : BUFFER_SIZE;
+        ssize_t n = send(sock, data + sent, length, 0);
+        if (n < 0) {
+            return -1;
+        }
+        sent += (size_t)n;
     }
-    srand(time(NULL));
-    for (unsigned int i = 0; i < size; i++)
-        buffer[i] = (char)(rand() % 256);
-    return buffer;
+    return 0;
 }
 
-
 //main function
 int main(int argc, char** argv) {
 
-    //check if the number of the arguments is indeed 7.
-    if (argc != 7) {
-        fprintf(stderr, "Usage: %s <port> <algorithm>\n", argv[0]);
+    //check that the 7 required arguments are there, followed by optional -data, -seed, -verify and tuning pairs
+    Util_Tuning tuning;
+    util_tuning_init(&tuning);
+    int data_mode = DATAGEN_RANDOM;
+    int verify = 0;
+    unsigned long long seed = 1;
+    int usage_ok = argc >= 7 && argc % 2 == 1;
+    for (int i = 7; usage_ok && i < argc; i += 2) {
+        if (strcmp(argv[i], "-data") == 0) {
+            data_mode = util_datagen_mode(argv[i + 1]);
+            usage_ok = data_mode >= 0;
+        } else if (strcmp(argv[i], "-seed") == 0) {
+            usage_ok = sscanf(argv[i + 1], "%llu", &seed) == 1;
+        } else if (strcmp(argv[i], "-verify") == 0) {
+            verify = strcmp(argv[i + 1], "on") == 0;
+            usage_ok = verify || strcmp(argv[i + 1], "off") == 0;
+        } else {
+            usage_ok = util_tuning_option(&tuning, argv[i], argv[i + 1]) > 0;
+        }
+    }
+    if (!usage_ok) {
+        fprintf(stderr, "Usage: %s -ip <address|host> -p <port> -algo <reno|cubic> [-data <random|text|pattern|zero>] [-seed <n>] [-verify <on|off>] " UTIL_TUNING_USAGE "\n", argv[0]);
         return 1;
     }
 
@@ -56,68 +80,81 @@ int main(int argc, char** argv) {
     //defining the lengh of the algorithm name
     socklen_t len = strlen(algorithm);
 
-    //creating a socket
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    //checking that the socket created succesfully
-    if (sock < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+    //looking up the server's address or host name, IPv4 or IPv6
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *server_address = NULL;
+    int err = getaddrinfo(SERVER_IP, argv[4], &hints, &server_address);
+    if (err != 0) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", SERVER_IP, gai_strerror(err));
+        return 1;
     }
 
-    //setting the algorithm in the socket to be the input algorithm
-    if (setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, algorithm, len) != 0) {
-        perror("setsockopt");
-        close(sock);
-        exit(EXIT_FAILURE);
-    }
+    //trying the server's addresses in order until one connects, a dual-stack name may list an unreachable family first
+    int sock = -1;
+    for (struct addrinfo *candidate = server_address; candidate != NULL; candidate = candidate->ai_next) {
+        //creating a socket of this address's family
+        sock = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+        if (sock < 0) {
+            perror("Socket creation failed");
+            continue;
+        }
 
+        //setting the algorithm in the socket to be the input algorithm
+        if (setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, algorithm, len) != 0) {
+            perror("setsockopt");
+            close(sock);
+            sock = -1;
+            continue;
+        }
 
-    struct sockaddr_in server_address;
-    memset(&server_address, 0, sizeof(server_address));
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = inet_addr(SERVER_IP);
-    server_address.sin_port = htons(SERVER_PORT);
-    
-    //connecting to the server
-    if (connect(sock, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
+        //buffer sizes have to be set before connecting, the window scale is fixed by the handshake
+        util_tuning_apply(sock, &tuning);
+
+        //connecting to the server
+        if (connect(sock, candidate->ai_addr, candidate->ai_addrlen) == 0) {
+            break;
+        }
         perror("Connection failed");
         close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(server_address);
+    if (sock < 0) {
+        fprintf(stderr, "Could not connect to %s\n", SERVER_IP);
         exit(EXIT_FAILURE);
     }
 
-    while (1) {
-        // Generate random data
-        unsigned int file_size = 2 * 1024 * 1024; // 2MB
-        char *data = util_generate_random_data(file_size);
-
-        // Write data to a file
-        FILE *file = fopen("file.txt", "wb");
-        if (file == NULL) {
-            perror("File opening failed");
-            exit(EXIT_FAILURE);
+    util_tuning_pin(&tuning);
+    Util_Tuning effective;
+    if (util_tuning_effective(sock, &effective) == 0) {
+        util_tuning_print("Socket tuning", &effective);
+    }
+
+    // Generate the data once, every round sends the same bytes straight from memory
+    size_t file_size = 2 * 1024 * 1024; // 2MB
+    char *data = util_generate_data(file_size, data_mode, seed);
+
+    //with -verify on, every file is followed by its XXH64 digest in network byte order, for a receiver started with -verify
+    unsigned char digest_buf[8];
+    if (verify) {
+        Util_Digest digest;
+        util_digest_init(&digest, 0);
+        util_digest_update(&digest, data, file_size);
+        uint64_t file_digest = util_digest_final(&digest);
+        for (int i = 0; i < 8; i++) {
+            digest_buf[i] = (unsigned char)(file_digest >> (56 - 8 * i));
         }
-        fwrite(data, sizeof(char), file_size, file);
-        fclose(file);
+    }
 
-        // Send the file
-        file = fopen("file.txt", "rb");
-        if (file == NULL) {
-            perror("File opening failed");
+    while (1) {
+        // Send the data, then the digest the same way
+        if (send_all(sock, data, file_size) < 0 || (verify && send_all(sock, (char *)digest_buf, sizeof(digest_buf)) < 0)) {
+            perror("Send failed");
             exit(EXIT_FAILURE);
         }
-        char buffer[BUFFER_SIZE];
-        size_t bytes_read;
-        //reading the data from the file
-        while ((bytes_read = fread(buffer, sizeof(char), BUFFER_SIZE, file)) > 0) {
-            if (send(sock, buffer, bytes_read, 0) < 0) {
-                perror("Send failed");
-                exit(EXIT_FAILURE);
-            }
-        }
-        fclose(file);
-
-        // Cleanup
-        free(data);
 
         // Prompt user for decision if it wants to send the file again or not
         char choice;
@@ -127,6 +164,7 @@ int main(int argc, char** argv) {
             break; // Exit the loop
         }
     }
+    free(data);
     close(sock);
 
     printf("Client ended.\n");
@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include "Util_DataGen.h"
+
+#define LANES 8 // Generators stepped side by side, the loop over them vectorizes
+#define BLOCK_BYTES (LANES * sizeof(uint64_t))
+#define RANDOM_CHUNK_BLOCKS 64 // Blocks generated at once into the bounce buffer for an unaligned output
+#define PATTERN_BYTES 4096 // Length of the block repeated by DATAGEN_PATTERN
+#define TEXT_WORDS 64
+#define TEXT_SEPARATORS 4
+#define TEXT_PIECE_BYTES 16 // A word and its separator, padded
+
+//xoshiro256++ state of every lane, one array per state word so each step is a plain loop over the lanes
+typedef struct {
+    uint64_t s0[LANES];
+    uint64_t s1[LANES];
+    uint64_t s2[LANES];
+    uint64_t s3[LANES];
+} Xoshiro;
+
+//spreads a seed into well mixed state words
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void xoshiro_seed(Xoshiro *x, uint64_t seed) {
+    uint64_t state = seed;
+    for (int i = 0; i < LANES; i++) {
+        x->s0[i] = splitmix64(&state);
+        x->s1[i] = splitmix64(&state);
+        x->s2[i] = splitmix64(&state);
+        x->s3[i] = splitmix64(&state);
+    }
+}
+
+//steps every lane once, writing LANES little-endian words so the bytes are the same on any machine.
+//the state stays in locals across the blocks, so the compiler keeps it in vector registers
+static void xoshiro_fill(Xoshiro *x, uint64_t *out, size_t blocks) {
+    uint64_t s0[LANES], s1[LANES], s2[LANES], s3[LANES];
+    memcpy(s0, x->s0, sizeof(s0));
+    memcpy(s1, x->s1, sizeof(s1));
+    memcpy(s2, x->s2, sizeof(s2));
+    memcpy(s3, x->s3, sizeof(s3));
+    for (size_t block = 0; block < blocks; block++) {
+        for (int i = 0; i < LANES; i++) {
+            uint64_t sum = s0[i] + s3[i];
+            out[block * LANES + i] = htole64(((sum << 23) | (sum >> 41)) + s0[i]);
+            uint64_t t = s1[i] << 17;
+            s2[i] ^= s0[i];
+            s3[i] ^= s1[i];
+            s1[i] ^= s2[i];
+            s0[i] ^= s3[i];
+            s2[i] ^= t;
+            s3[i] = (s3[i] << 45) | (s3[i] >> 19);
+        }
+    }
+    memcpy(x->s0, s0, sizeof(s0));
+    memcpy(x->s1, s1, sizeof(s1));
+    memcpy(x->s2, s2, sizeof(s2));
+    memcpy(x->s3, s3, sizeof(s3));
+}
+
+//whole blocks are generated in place, only the tail goes through a bounce buffer
+static void fill_random(unsigned char *out, size_t size, uint64_t seed) {
+    Xoshiro x;
+    xoshiro_seed(&x, seed);
+    size_t blocks = size / BLOCK_BYTES;
+    uint64_t *aligned = ((uintptr_t)out % sizeof(uint64_t)) == 0 ? (uint64_t *)out : NULL;
+    uint64_t block[LANES * RANDOM_CHUNK_BLOCKS];
+    size_t done = 0;
+    while (blocks > 0) {
+        size_t count = blocks;
+        if (aligned == NULL && count > RANDOM_CHUNK_BLOCKS) {
+            count = RANDOM_CHUNK_BLOCKS;
+        }
+        if (aligned != NULL) {
+            xoshiro_fill(&x, aligned + done / sizeof(uint64_t), count);
+        } else {
+            xoshiro_fill(&x, block, count);
+            memcpy(out + done, block, count * BLOCK_BYTES);
+        }
+        done += count * BLOCK_BYTES;
+        blocks -= count;
+    }
+    if (done < size) {
+        xoshiro_fill(&x, block, 1);
+        memcpy(out + done, block, size - done);
+    }
+}
+
+//common words, so the text has the repetition LZ-style compression finds in prose
+static const char *const words[TEXT_WORDS] = {
+    "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with", "be", "by", "on",
+    "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had", "they", "you", "were",
+    "their", "one", "all", "we", "can", "her", "has", "there", "been", "if", "more", "when", "will", "would", "who", "so",
+    "no", "packet", "network", "segment", "window", "delay", "sender", "receiver", "data", "time", "rate", "loss", "order", "buffer",
+};
+static const char *const separators[TEXT_SEPARATORS] = {" ", ", ", ". ", ".\n"};
+
+//every word with every separator, padded to a fixed size so a piece is copied with one fixed-length memcpy
+typedef struct {
+    char text[TEXT_PIECE_BYTES];
+    size_t length;
+} TextPiece;
+
+static TextPiece pieces[TEXT_WORDS * TEXT_SEPARATORS];
+
+static void build_pieces(void) {
+    for (int w = 0; w < TEXT_WORDS; w++) {
+        for (int p = 0; p < TEXT_SEPARATORS; p++) {
+            TextPiece *piece = &pieces[w * TEXT_SEPARATORS + p];
+            piece->length = (size_t)snprintf(piece->text, sizeof(piece->text), "%s%s", words[w], separators[p]);
+        }
+    }
+}
+
+//words picked by the generator, 16 random bits each: the word, then mostly a space, sometimes a comma, a full stop or a line break
+static void fill_text(unsigned char *out, size_t size, uint64_t seed) {
+    if (pieces[0].length == 0) {
+        build_pieces();
+    }
+    Xoshiro x;
+    xoshiro_seed(&x, seed);
+    uint64_t block[LANES];
+    size_t done = 0;
+    while (done < size) {
+        xoshiro_fill(&x, block, 1);
+        for (int i = 0; i < LANES * 4 && done < size; i++) {
+            unsigned int bits = (unsigned int)(le64toh(block[i / 4]) >> (16 * (i % 4))) & 0xffff;
+            unsigned int kind = (bits >> 6) & 15;
+            unsigned int separator = kind < 10 ? 0 : kind < 13 ? 1 : kind < 15 ? 2 : 3;
+            const TextPiece *piece = &pieces[(bits % TEXT_WORDS) * TEXT_SEPARATORS + separator];
+            if (size - done >= TEXT_PIECE_BYTES) {
+                memcpy(out + done, piece->text, TEXT_PIECE_BYTES);
+                done += piece->length;
+            } else {
+                size_t length = piece->length < size - done ? piece->length : size - done;
+                memcpy(out + done, piece->text, length);
+                done += length;
+            }
+        }
+    }
+}
+
+//a random block, then copies of what is already there, doubling each time
+static void fill_pattern(unsigned char *out, size_t size, uint64_t seed) {
+    size_t done = size < PATTERN_BYTES ? size : PATTERN_BYTES;
+    fill_random(out, done, seed);
+    while (done < size) {
+        size_t length = done < size - done ? done : size - done;
+        memcpy(out + done, out, length);
+        done += length;
+    }
+}
+
+// The DATAGEN_* mode with the given name, -1 for an unknown one
+int util_datagen_mode(const char *name) {
+    if (strcmp(name, "random") == 0) {
+        return DATAGEN_RANDOM;
+    } else if (strcmp(name, "text") == 0) {
+        return DATAGEN_TEXT;
+    } else if (strcmp(name, "pattern") == 0) {
+        return DATAGEN_PATTERN;
+    } else if (strcmp(name, "zero") == 0) {
+        return DATAGEN_ZERO;
+    }
+    return -1;
+}
+
+// Fills the buffer with data of the given mode
+void util_datagen_fill(void *buffer, size_t size, int mode, uint64_t seed) {
+    switch (mode) {
+        case DATAGEN_TEXT:
+            fill_text(buffer, size, seed);
+            break;
+        case DATAGEN_PATTERN:
+            fill_pattern(buffer, size, seed);
+            break;
+        case DATAGEN_ZERO:
+            memset(buffer, 0, size);
+            break;
+        default:
+            fill_random(buffer, size, seed);
+            break;
+    }
+}
+
+// Allocates and fills a buffer of test data
+char *util_generate_data(size_t size, int mode, uint64_t seed) {
+    char *buffer = malloc(size > 0 ? size : 1);
+    if (buffer == NULL) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    util_datagen_fill(buffer, size, mode, seed);
+    return buffer;
+}
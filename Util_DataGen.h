@@ -0,0 +1,25 @@
+#ifndef UTIL_DATAGEN_H
+#define UTIL_DATAGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Test data for the senders, generated at memory speed so it does not skew the measured transfers.
+// The same mode, seed and size always give the same bytes, on any machine.
+
+// Kinds of data that can be generated
+#define DATAGEN_RANDOM  0 // Uniformly random bytes, incompressible
+#define DATAGEN_TEXT    1 // Words and punctuation, compresses about like prose
+#define DATAGEN_PATTERN 2 // A short random block repeated, compresses almost completely
+#define DATAGEN_ZERO    3 // All zero bytes
+
+// The DATAGEN_* mode with the given name (random, text, pattern or zero), -1 for an unknown name
+int util_datagen_mode(const char *name);
+
+// Fills size bytes at buffer with data of the given mode
+void util_datagen_fill(void *buffer, size_t size, int mode, uint64_t seed);
+
+// Allocates size bytes and fills them with data of the given mode, exits when out of memory
+char *util_generate_data(size_t size, int mode, uint64_t seed);
+
+#endif
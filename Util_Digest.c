@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <endian.h>
+#include "Util_Digest.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+//input words are little-endian, so the digest is the same on any machine
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    return rotl64(acc, 31) * PRIME1;
+}
+
+static uint64_t merge_round(uint64_t hash, uint64_t acc) {
+    hash ^= round64(0, acc);
+    return hash * PRIME1 + PRIME4;
+}
+
+//runs the four accumulators over whole stripes, returns the bytes consumed
+static size_t consume_stripes(uint64_t *acc, const unsigned char *p, size_t length) {
+    uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+    size_t done = 0;
+    for (; done + UTIL_DIGEST_STRIPE <= length; done += UTIL_DIGEST_STRIPE) {
+        a0 = round64(a0, read64(p + done));
+        a1 = round64(a1, read64(p + done + 8));
+        a2 = round64(a2, read64(p + done + 16));
+        a3 = round64(a3, read64(p + done + 24));
+    }
+    acc[0] = a0;
+    acc[1] = a1;
+    acc[2] = a2;
+    acc[3] = a3;
+    return done;
+}
+
+// Starts a new digest
+void util_digest_init(Util_Digest *digest, uint64_t seed) {
+    digest->acc[0] = seed + PRIME1 + PRIME2;
+    digest->acc[1] = seed + PRIME2;
+    digest->acc[2] = seed;
+    digest->acc[3] = seed - PRIME1;
+    digest->total = 0;
+    digest->pending_bytes = 0;
+    digest->seed = seed;
+}
+
+// Adds the next length bytes of the message
+void util_digest_update(Util_Digest *digest, const void *data, size_t length) {
+    const unsigned char *p = data;
+    digest->total += length;
+
+    //complete a stripe started by an earlier piece first
+    if (digest->pending_bytes > 0) {
+        size_t fill = UTIL_DIGEST_STRIPE - digest->pending_bytes;
+        if (fill > length) {
+            fill = length;
+        }
+        memcpy(digest->pending + digest->pending_bytes, p, fill);
+        digest->pending_bytes += fill;
+        p += fill;
+        length -= fill;
+        if (digest->pending_bytes < UTIL_DIGEST_STRIPE) {
+            return;
+        }
+        consume_stripes(digest->acc, digest->pending, UTIL_DIGEST_STRIPE);
+        digest->pending_bytes = 0;
+    }
+
+    size_t done = consume_stripes(digest->acc, p, length);
+    memcpy(digest->pending, p + done, length - done);
+    digest->pending_bytes = length - done;
+}
+
+// The digest of everything fed so far, more data can still follow
+uint64_t util_digest_final(const Util_Digest *digest) {
+    uint64_t hash;
+    if (digest->total >= UTIL_DIGEST_STRIPE) {
+        const uint64_t *acc = digest->acc;
+        hash = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) + rotl64(acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = merge_round(hash, acc[i]);
+        }
+    } else {
+        hash = digest->seed + PRIME5;
+    }
+    hash += digest->total;
+
+    const unsigned char *p = digest->pending;
+    unsigned int left = digest->pending_bytes;
+    for (; left >= 8; left -= 8, p += 8) {
+        hash ^= round64(0, read64(p));
+        hash = rotl64(hash, 27) * PRIME1 + PRIME4;
+    }
+    if (left >= 4) {
+        hash ^= (uint64_t)read32(p) * PRIME1;
+        hash = rotl64(hash, 23) * PRIME2 + PRIME3;
+        left -= 4;
+        p += 4;
+    }
+    for (; left > 0; left--, p++) {
+        hash ^= *p * PRIME5;
+        hash = rotl64(hash, 11) * PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
@@ -0,0 +1,29 @@
+#ifndef UTIL_DIGEST_H
+#define UTIL_DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A 64-bit XXH64 digest of a message, fed piece by piece as it is sent or received.
+// Only meant to catch data that changed on the way, it is not a cryptographic hash.
+
+#define UTIL_DIGEST_STRIPE 32 // Bytes consumed by one round of the four accumulators
+
+typedef struct {
+    uint64_t acc[4];                           // Accumulators of the whole stripes so far
+    uint64_t total;                            // Bytes fed so far
+    unsigned char pending[UTIL_DIGEST_STRIPE]; // Start of a stripe not complete yet
+    unsigned int pending_bytes;
+    uint64_t seed;
+} Util_Digest;
+
+// Starts a new digest
+void util_digest_init(Util_Digest *digest, uint64_t seed);
+
+// Adds the next length bytes of the message
+void util_digest_update(Util_Digest *digest, const void *data, size_t length);
+
+// The digest of everything fed so far, more data can still follow
+uint64_t util_digest_final(const Util_Digest *digest);
+
+#endif
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include "Util_Tune.h"
+
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70 // Linux 5.11, missing from older headers
+#endif
+
+// Leaves every setting at the kernel's default
+void util_tuning_init(Util_Tuning *tuning) {
+    tuning->sndbuf = 0;
+    tuning->rcvbuf = 0;
+    tuning->busy_poll_us = 0;
+    tuning->busy_poll_budget = 0;
+    tuning->dscp = -1;
+    tuning->cpu = -1;
+}
+
+//a whole number in [min, max], -1 for anything else
+static int parse_number(const char *value, long min, long max) {
+    char *end;
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || number < min || number > max) {
+        return -1;
+    }
+    return (int)number;
+}
+
+// Takes a command line option and its value if it is a tuning option
+int util_tuning_option(Util_Tuning *tuning, const char *option, const char *value) {
+    int *field;
+    long max = 0x7fffffff;
+    if (strcmp(option, "-sndbuf") == 0) {
+        field = &tuning->sndbuf;
+    } else if (strcmp(option, "-rcvbuf") == 0) {
+        field = &tuning->rcvbuf;
+    } else if (strcmp(option, "-busypoll") == 0) {
+        field = &tuning->busy_poll_us;
+    } else if (strcmp(option, "-busybudget") == 0) {
+        field = &tuning->busy_poll_budget;
+        max = 0xffff;
+    } else if (strcmp(option, "-dscp") == 0) {
+        field = &tuning->dscp;
+        max = 63;
+    } else if (strcmp(option, "-cpu") == 0) {
+        field = &tuning->cpu;
+        max = CPU_SETSIZE - 1;
+    } else {
+        return 0;
+    }
+    if (value == NULL || (*field = parse_number(value, 0, max)) < 0) {
+        fprintf(stderr, "Invalid value for %s: %s\n", option, value != NULL ? value : "(none)");
+        return -1;
+    }
+    return 1;
+}
+
+//sets a buffer size, past net.core.{r,w}mem_max when we have CAP_NET_ADMIN
+static int set_buffer(int fd, int force_option, int option, int bytes, const char *name) {
+    if (setsockopt(fd, SOL_SOCKET, force_option, &bytes, sizeof(bytes)) == 0) {
+        return 0;
+    }
+    //without the capability the size is capped at the system limit
+    if (setsockopt(fd, SOL_SOCKET, option, &bytes, sizeof(bytes)) < 0) {
+        fprintf(stderr, "Setting %s failed: %s\n", name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int set_int(int fd, int level, int option, int value, const char *name) {
+    if (setsockopt(fd, level, option, &value, sizeof(value)) < 0) {
+        fprintf(stderr, "Setting %s failed: %s\n", name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Applies the socket options of the tuning
+int util_tuning_apply(int fd, const Util_Tuning *tuning) {
+    int result = 0;
+    if (tuning->sndbuf > 0 && set_buffer(fd, SO_SNDBUFFORCE, SO_SNDBUF, tuning->sndbuf, "SO_SNDBUF") < 0) {
+        result = -1;
+    }
+    if (tuning->rcvbuf > 0 && set_buffer(fd, SO_RCVBUFFORCE, SO_RCVBUF, tuning->rcvbuf, "SO_RCVBUF") < 0) {
+        result = -1;
+    }
+    //raising the busy poll time or budget above the system default needs CAP_NET_ADMIN
+    if (tuning->busy_poll_us > 0 && set_int(fd, SOL_SOCKET, SO_BUSY_POLL, tuning->busy_poll_us, "SO_BUSY_POLL") < 0) {
+        result = -1;
+    }
+    if (tuning->busy_poll_budget > 0 && set_int(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, tuning->busy_poll_budget, "SO_BUSY_POLL_BUDGET") < 0) {
+        result = -1;
+    }
+    if (tuning->dscp >= 0) {
+        //the code point is the upper six bits of the TOS byte, or of the IPv6 traffic class
+        int domain = AF_INET;
+        socklen_t domain_len = sizeof(domain);
+        getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &domain_len);
+        //a dual-stack socket marks what it sends to v4-mapped peers by the TOS byte
+        int marked = set_int(fd, IPPROTO_IP, IP_TOS, tuning->dscp << 2, "IP_TOS");
+        if (domain == AF_INET6 && set_int(fd, IPPROTO_IPV6, IPV6_TCLASS, tuning->dscp << 2, "IPV6_TCLASS") < 0) {
+            marked = -1;
+        }
+        if (marked < 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+// Pins the calling thread to the tuning's CPU
+int util_tuning_pin(const Util_Tuning *tuning) {
+    if (tuning->cpu < 0) {
+        return 0;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(tuning->cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "Pinning to CPU %d failed: %s\n", tuning->cpu, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int get_int(int fd, int level, int option) {
+    int value = 0;
+    socklen_t length = sizeof(value);
+    if (getsockopt(fd, level, option, &value, &length) < 0) {
+        return -1;
+    }
+    return value;
+}
+
+// Reads back what the kernel uses for the socket and the calling thread
+int util_tuning_effective(int fd, Util_Tuning *effective) {
+    util_tuning_init(effective);
+    //the kernel reports twice the usable size to account for its bookkeeping
+    int sndbuf = get_int(fd, SOL_SOCKET, SO_SNDBUF);
+    int rcvbuf = get_int(fd, SOL_SOCKET, SO_RCVBUF);
+    if (sndbuf < 0 || rcvbuf < 0) {
+        perror("getsockopt");
+        return -1;
+    }
+    effective->sndbuf = sndbuf / 2;
+    effective->rcvbuf = rcvbuf / 2;
+    effective->busy_poll_us = get_int(fd, SOL_SOCKET, SO_BUSY_POLL);
+    effective->busy_poll_budget = get_int(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET);
+    int domain = get_int(fd, SOL_SOCKET, SO_DOMAIN);
+    int tos = domain == AF_INET6 ? get_int(fd, IPPROTO_IPV6, IPV6_TCLASS) : get_int(fd, IPPROTO_IP, IP_TOS);
+    effective->dscp = tos >= 0 ? tos >> 2 : -1;
+
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) == 1) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                effective->cpu = cpu;
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+// Prints effective settings on one line
+void util_tuning_print(const char *label, const Util_Tuning *effective) {
+    printf("%s: sndbuf=%d; rcvbuf=%d; busy_poll=%dus", label, effective->sndbuf, effective->rcvbuf, effective->busy_poll_us);
+    if (effective->busy_poll_budget >= 0) {
+        printf("; busy_poll_budget=%d", effective->busy_poll_budget);
+    }
+    printf("; dscp=%d", effective->dscp);
+    if (effective->cpu >= 0) {
+        printf("; cpu=%d", effective->cpu);
+    } else {
+        printf("; cpu=any");
+    }
+    printf("\n");
+}
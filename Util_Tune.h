@@ -0,0 +1,40 @@
+#ifndef UTIL_TUNE_H
+#define UTIL_TUNE_H
+
+// Socket and thread tuning shared by the RUDP and TCP tools: buffer sizes, busy polling, DSCP marking and CPU pinning.
+// Settings the kernel refuses are reported and skipped, what it actually applied can be read back and printed.
+
+// What to apply, a field left at its default leaves the kernel's setting alone
+typedef struct {
+    int sndbuf;           // SO_SNDBUF in bytes, 0 for the default
+    int rcvbuf;           // SO_RCVBUF in bytes, 0 for the default
+    int busy_poll_us;     // SO_BUSY_POLL: how long a blocking receive spins on the device queue, 0 for the default
+    int busy_poll_budget; // SO_BUSY_POLL_BUDGET: packets handled per busy poll, 0 for the default
+    int dscp;             // Differentiated services code point 0-63 put in IP_TOS and IPV6_TCLASS, -1 for the default
+    int cpu;              // CPU the calling thread is pinned to, -1 not to pin it
+} Util_Tuning;
+
+// Leaves every setting at the kernel's default
+void util_tuning_init(Util_Tuning *tuning);
+
+// Takes a command line option and its value if it is a tuning option (-sndbuf, -rcvbuf, -busypoll, -busybudget, -dscp, -cpu).
+// Returns 1 when it was one, 0 when it is not a tuning option and -1 for an invalid value.
+int util_tuning_option(Util_Tuning *tuning, const char *option, const char *value);
+
+// Usage text of the tuning options, for the tools' usage lines
+#define UTIL_TUNING_USAGE "[-sndbuf <bytes>] [-rcvbuf <bytes>] [-busypoll <us>] [-busybudget <packets>] [-dscp <0-63>] [-cpu <n>]"
+
+// Applies the socket options, buffers above the system limits are forced when we may (SO_RCVBUFFORCE, SO_SNDBUFFORCE).
+// Returns 0 when everything was applied, -1 when the kernel refused something.
+int util_tuning_apply(int fd, const Util_Tuning *tuning);
+
+// Pins the calling thread to the tuning's CPU, if it names one
+int util_tuning_pin(const Util_Tuning *tuning);
+
+// Reads back what the kernel uses for the socket and the calling thread: the buffer sizes as usable bytes, cpu -1 when not pinned to one
+int util_tuning_effective(int fd, Util_Tuning *effective);
+
+// Prints effective settings on one line
+void util_tuning_print(const char *label, const Util_Tuning *effective);
+
+#endif